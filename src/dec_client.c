@@ -10,6 +10,30 @@
 *                right service and sends all relevant data.  It then waits to receive a plaintext response which
 *                it prints to stdout (which can be redirected).
 *
+*                Larger ciphertexts are split into stripes which are each sent over their own connection, spread
+*                across one or more server ports (ie "5001,5002"), and reassembled in order.  Stripes are read
+*                straight from the files and kept under the server's message size, so ciphertexts of any size can
+*                be sent.
+*
+*                With -r newkey the ciphertext is re-keyed instead of decrypted: the server converts it straight
+*                from the old key to the new key in one pass and returns the new ciphertext, so the plaintext
+*                never leaves the server.
+*
+*                With -a the files are submitted as an async job of upto 1GB, streamed to the server with sendfile()
+*                instead of being loaded, and the job ID is printed.  -F fetches the job's plaintext by that ID,
+*                waiting while the job is still running.
+*
+*                With -C the ciphertext is read from a block container written by enc_client -C, and -x start[:len]
+*                picks the range of it to decrypt (the rest of the container by default).  Only the index entries,
+*                blocks and pieces of the key covering the range are read, and each block is its own request.
+*
+*                With -m the request goes to a co-located dec_server over its shared memory transport instead of a
+*                socket.  Requests of upto 4096 chars are written into rings in a channel the server hands over on a
+*                unix socket.  -n repeats the request that many times, keeping the rings full, and reports the rate.
+*
+*                With -b the files are treated as raw bytes for the binary pad (ciphertext XOR key) and the
+*                plaintext is written out as raw bytes without a trailing newline.
+*
 */
 
 #define _GNU_SOURCE
@@ -19,7 +43,19 @@
 #include <string.h>
 #include <sys/types.h>  // ssize_t
 #include <sys/socket.h> // send(),recv()
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY
 #include <netdb.h>      // gethostbyname()
+#include <sys/mman.h>   // mmap()
+#include <sys/wait.h>   // wait()
+#include <fcntl.h>      // open(), splice(), fallocate()
+#include <sys/stat.h>   // fstat()
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <time.h>
 
 
 // Declare Global Resources 
@@ -27,6 +63,69 @@ static const char *HOSTNAME = "localhost";           // hostname used in creatin
 static const int MAX_MSG_SIZE = 100000;              // maximum size of data to be sent
 static const int MAX_TRANSMISSION_SIZE = 1024;       // maximum size of data for transmission to server
 static const char validChars[27] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+static const int STRIPE_MIN_SIZE = 16384;            // minimum size of data per stripe connection
+static const int MAX_STRIPES_PER_PORT = 5;           // servers handle upto 5 concurrent requests
+static const int MAX_JOB_SIZE = 1 << 30;             // maximum size of data for an async job
+#define SHM_RING_SLOTS 64                            // requests in flight over shared memory
+#define SHM_MAX_DATA 4096                            // largest request taken over shared memory
+static const int SHM_MIN_SPIN = 64;                  // bounds on ring checks made before sleeping on a futex
+static const int SHM_MAX_SPIN = 65536;
+#define MAX_PORTS 16                                 // maximum number of server ports to stripe across
+static int binaryMode = 0;                           // set by -b, requests use the binary XOR pad
+static int outputFD = -1;                            // set by -o, replies are spliced straight into this file
+
+// Outcome of a shared memory request
+enum shmStatus { SHM_DONE, SHM_INVALID, SHM_THROTTLED };
+
+struct shmRequest
+{
+    int len;                                         // chars of ciphertext and key
+    int binary;                                      // 1 for the binary pad
+    char ciphertext[SHM_MAX_DATA];
+    char key[SHM_MAX_DATA];
+};
+
+struct shmReply
+{
+    int status;                                      // shmStatus of the request
+    int len;                                         // chars of plaintext, or ms to wait for SHM_THROTTLED
+    char plaintext[SHM_MAX_DATA];
+};
+
+// Producer and consumer indexes count up forever and are masked into slots, each on its own cache line
+struct shmRing
+{
+    uint32_t tail __attribute__((aligned(64)));      // slots published by the producer, also the futex word
+    uint32_t sleeping;                               // 1 while the consumer is asleep on tail
+    uint32_t head __attribute__((aligned(64)));      // slots taken by the consumer
+};
+
+struct shmChannel
+{
+    char magic[8];                                   // "OTPRING1", checked by clients
+    struct shmRing submit __attribute__((aligned(64)));
+    struct shmRing complete;
+    struct shmRequest requests[SHM_RING_SLOTS];
+    struct shmReply replies[SHM_RING_SLOTS];
+};
+
+// A block container (-C) holds a ciphertext as fixed size blocks behind an index, so any range can be decrypted by
+// fetching just the blocks covering it. Layout is the header, then an entry per block, then the blocks in order
+struct containerHeader
+{
+    char magic[8];                                   // "OTPBLKS1"
+    int32_t binary;                                  // 1 if the blocks use the binary pad
+    int32_t blockSize;                               // chars per block, the last block may be shorter
+    int64_t dataLength;                              // total chars of ciphertext
+    int64_t numBlocks;
+};
+
+struct containerBlock
+{
+    int64_t dataOffset;                              // where the block's ciphertext starts in the container
+    int64_t padOffset;                               // where the block's pad starts in the key
+    int64_t length;                                  // chars in the block
+};
 
 // Error function used for reporting issues with errno
 void error(const char *msg)
@@ -73,14 +172,27 @@ int sendData(int socketFD, char *msg)
     return charsWritten;
 }
 
+// Send upto len bytes of data via provided socket.  If more is set further chunks follow straight after, so the
+// kernel holds partial segments back (MSG_MORE) until the last chunk flushes them
+int sendChunk(int socketFD, char *data, int len, int more)
+{
+    int charsWritten = send(socketFD, data, len, more ? MSG_MORE : 0);     // Sends data to a socket File Descriptor
+    if (charsWritten < 0)                                                   // Error check sent data
+    {                                          
+        error("CLIENT: ERROR writing to socket");
+    }
+    return charsWritten;
+}
+
 // Read data via provided socket
 int readData(int socketFD, char *buffer, int bufferLen)
 {
     memset(buffer, '\0', bufferLen);                                        // Clear out buffers and charsRead for next recv
-    int charsRead = 0;
-    while (charsRead == 0)                                                  // Wait for next available recv data
+    int charsRead = recv(socketFD, buffer, bufferLen - 1, 0);               // Read the server's message from the socket
+    if (charsRead == 0)                                                     // Server hung up before finishing request
     {
-        charsRead = recv(socketFD, buffer, bufferLen - 1, 0);               // Read the client's message from the socket
+        fprintf(stderr, "Error: server closed connection\n");
+        exit(2);
     }
     if (charsRead < 0)                                                      // Error check received data
     {                                          
@@ -93,6 +205,27 @@ int readData(int socketFD, char *buffer, int bufferLen)
     return charsRead;
 }
 
+// Reads a whole binary input file (any bytes, no alphabet check) into buffer and returns its length
+int readBinaryFile(char *fileName, char *buffer, int bufferLen)
+{
+    char filePath[256];
+    snprintf(filePath, sizeof(filePath), "./%s", fileName);
+    FILE *file = fopen(filePath, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr,"Invalid File: specified file \'%s\' not found\n", fileName);
+        exit(1);
+    }
+    int len = fread(buffer, 1, bufferLen, file);
+    if (len == bufferLen && fgetc(file) != EOF)                            // must leave room for the full request
+    {
+        fprintf(stderr,"Error: \'%s\' is too large\n", fileName);
+        exit(1);
+    }
+    fclose(file);
+    return len;
+}
+
 // Check if input file contains only valid chars via validChar mapping
 void checkFileForValidChars(char *input, char *fileName)
 {
@@ -119,133 +252,171 @@ void checkFileForValidChars(char *input, char *fileName)
     }
 }
 
-int main(int argc, char *argv[])
+// Check if the server throttled the request and report how long to wait before retrying
+void checkThrottled(char *response, int portNumber)
 {
-    int socketFD, portNumber, charsWritten, charsRead, ciphertextLen, keyLen;
-    struct sockaddr_in serverAddress;
-    char buffer[MAX_TRANSMISSION_SIZE];
-    char ciphertext[MAX_MSG_SIZE];
-    char key[MAX_MSG_SIZE];
-    char plaintext[MAX_MSG_SIZE];
-    char filePath[256];
-
-
-    /*-- Check usage & args --*/
-    if (argc < 4) 
-    { 
-        fprintf(stderr,"USAGE: %s plaintext key port\n", argv[0]); 
-        exit(0); 
+    int retryMs;
+    if (sscanf(response, "throttled %d", &retryMs) == 1)
+    {
+        fprintf(stderr, "Error: dec_server on port %d is throttling requests, retry after %d ms\n", portNumber, retryMs);
+        exit(3);
     }
+}
 
-    /*-- Check Plaintext and Key inputs --*/
-    // Clears all string storage for input
-    memset(filePath, '\0', sizeof(filePath));   
-    memset(ciphertext, '\0', sizeof(ciphertext));                           
-    memset(key, '\0', sizeof(key));                           
-
-    // Open specified plaintext file text for read only
-    strcpy(filePath, "./");                                                 // generate filepath
-    strcat(filePath, argv[1]); 
-    FILE *plaintextFile = fopen(filePath, "r");
-    if (plaintextFile == NULL)                                              // error handling for invalid files
+// Parse a comma separated list of ports (ie "5001,5002") into ports array, returns number of ports found
+int parsePorts(char *portList, int *ports, int maxPorts)
+{
+    int numPorts = 0;
+    char *savePtr;
+    char *token = strtok_r(portList, ",", &savePtr);
+    while (token != NULL && numPorts < maxPorts)
     {
-        fprintf(stderr,"Invalid File: specified plaintext file \'%s\' not found\n", argv[1]); 
-        exit(1);
+        ports[numPorts++] = atoi(token);
+        token = strtok_r(NULL, ",", &savePtr);
     }
+    return numPorts;
+}
 
-    // Check if Plaintext file has valid chars and store file size
-    fgets(ciphertext, sizeof(ciphertext) - 1, plaintextFile);               // stores file contents to str
-    fseek(plaintextFile, 0, SEEK_SET);                                      // reset pointer for next use
-    checkFileForValidChars(ciphertext, argv[1]);
-    ciphertextLen = strlen(ciphertext);                                     // store ciphertext len
-
-    // Open specified key file text for read only
-    memset(filePath, '\0', sizeof(filePath));                               // clear filepath    
-    strcpy(filePath, "./");                                                 // generate filepath
-    strcat(filePath, argv[2]); 
-    FILE *keyFile = fopen(filePath, "r");
-    if (keyFile == NULL)                                                    // error handling for invalid files
+// Picks the number of stripes to split a payload into based on its size, available cores and server ports
+int chooseStripeCount(long dataLen, int numPorts)
+{
+    long stripes = dataLen / STRIPE_MIN_SIZE;                              // only stripe once each stripe is worth a connection
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);                             // no point in more stripes than cores
+    if (cores > 0 && stripes > cores)
     {
-        fprintf(stderr,"Invalid File: specified key file %s not found\n", argv[2]);
-        exit(1);
+        stripes = cores;
     }
+    if (stripes > MAX_STRIPES_PER_PORT * numPorts)                          // each server only handles 5 requests at a time
+    {
+        stripes = MAX_STRIPES_PER_PORT * numPorts;
+    }
+    if (stripes < 1)
+    {
+        stripes = 1;
+    }
+    return stripes;
+}
 
-    // Check if key file has valid chars and store file size
-    fgets(key, sizeof(key) - 1, keyFile);                                   // stores file contents to str
-    fseek(keyFile, 0, SEEK_SET);                                            // reset pointer for next use
-    checkFileForValidChars(key, argv[2]);
-    keyLen = strlen(key);                                                   // store key len
+// Receives len chars of reply from the socket straight into outFD at offset with splice() through a pipe, so the
+// reply is written to disk without ever being copied into userspace
+void receiveToFile(int socketFD, int outFD, off_t offset, int len)
+{
+    int pipeFDs[2];
+    loff_t fileOffset = offset;                                             // explicit offset so stripes can share outFD
+    if (pipe(pipeFDs) < 0)
+    {
+        error("CLIENT: ERROR creating pipe");
+    }
+    while (len > 0)
+    {
+        ssize_t charsIn = splice(socketFD, NULL, pipeFDs[1], NULL, len, SPLICE_F_MOVE);
+        if (charsIn < 0)
+        {
+            error("CLIENT: ERROR splicing from socket");
+        }
+        if (charsIn == 0)                                                   // Server hung up before finishing request
+        {
+            fprintf(stderr, "Error: server closed connection\n");
+            exit(2);
+        }
+        len -= charsIn;
+        while (charsIn > 0)                                                 // drain the pipe into the file
+        {
+            ssize_t charsOut = splice(pipeFDs[0], NULL, outFD, &fileOffset, charsIn, SPLICE_F_MOVE);
+            if (charsOut <= 0)
+            {
+                error("CLIENT: ERROR splicing to output file");
+            }
+            charsIn -= charsOut;
+        }
+    }
+    close(pipeFDs[0]);
+    close(pipeFDs[1]);
+}
 
-    // check if plaintext is greater than key size, throw error and exit if true
-    if(keyLen < ciphertextLen){ 
-        fprintf(stderr,"Error: key \'%s\' is too short\n", argv[2]);
-        exit(1);
-	}
+// Runs a full decryption request for dataLen chars of ciphertext/key against the server on portNumber and
+// stores the resulting plaintext in plaintext (exactly dataLen chars), or at outOffset in the output file
+void runRequest(int portNumber, char *ciphertext, char *key, char *newKey, int dataLen, char *plaintext,
+                off_t outOffset)
+{
+    int socketFD, charsWritten, charsRead, chunkLen;
+    struct sockaddr_in serverAddress;
+    char buffer[MAX_TRANSMISSION_SIZE];
 
-    /*-- Create and Validate Encryption Socket Connection --*/
+    /*-- Create and Validate Decryption Socket Connection --*/
     // Create a socket
     socketFD = socket(AF_INET, SOCK_STREAM, 0); 
     if (socketFD < 0)
     {
         error("CLIENT: ERROR opening socket");
-		fprintf(stderr, "Error: could not contact enc_server on port %d\n", atoi(argv[3]));
+		fprintf(stderr, "Error: could not contact dec_server on port %d\n", portNumber);
         exit(2);
     }
 
     // Set up the server address struct
-    setupAddressStruct(&serverAddress, atoi(argv[3]));
+    setupAddressStruct(&serverAddress, portNumber);
 
     // Connect to server
     if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
     {
         error("CLIENT: ERROR connecting to server");
-		fprintf(stderr, "Error: could not contact enc_server on port %d\n", atoi(argv[3]));
+		fprintf(stderr, "Error: could not contact dec_server on port %d\n", portNumber);
         exit(2);
     }
+    int noDelay = 1;                                                        // MSG_MORE marks flush points instead of Nagle
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
 
     /*-- Validate Socket Connection Is For Right Decryption Service --*/
-    char* checkMsg = "dec_server";                                          // Send request type to server
+    // Send request type to server along with any binary pad / rekey options
+    char* checkMsg = binaryMode ? (newKey ? "dec_server binary rekey" : "dec_server binary")
+                                : (newKey ? "dec_server rekey" : "dec_server");
     sendData(socketFD, checkMsg);                                                               
     charsRead = readData(socketFD, buffer, sizeof(buffer));                 // Receive server response - accepted or denied
     if(strcmp(buffer, "denied") == 0){                                      // Check if server affirms correct connection type
-		fprintf(stderr, "Error: dec_client cannot use enc_server on port %d\n", atoi(argv[3]));
+		fprintf(stderr, "Error: dec_client cannot use enc_server on port %d\n", portNumber);
 		exit(2);    // if invalid, else exits
 	}
+    checkThrottled(buffer, portNumber);                                     // server may ask client to back off
 
     /*-- Send Ciphertext Data to Decryption Server --*/
     // Send data length
     memset(buffer, '\0', sizeof(buffer));                                   // Clear out buffers and charsread for next send
-	sprintf(buffer, "%d", ciphertextLen);
+	sprintf(buffer, "%d", dataLen);
     sendData(socketFD, buffer);                                             // Send ciphertext length to server
     charsRead = readData(socketFD, buffer, sizeof(buffer));                 // Receive server response - continue msg
+    checkThrottled(buffer, portNumber);
 
     // Send ciphertext data to dec_server
     charsWritten = 0;
-    // continues to write cipher data to client until cipher length reached
-    while (charsWritten < ciphertextLen)
+    // continues to write ciphertext data to server in transmission sized chunks until ciphertext length reached
+    while (charsWritten < dataLen)
     {
-        memset(buffer, '\0', sizeof(buffer));                               // Clear out buffer for next line
-        fgets(buffer, sizeof(buffer) - 1, plaintextFile);                   // Get buffer sized chunk from plaintext
-        buffer[strcspn(buffer, "\n")] = '\0';                               // Remove the trailing \n that fgets adds
-        charsWritten += sendData(socketFD, buffer);
+        chunkLen = dataLen - charsWritten;
+        if (chunkLen > MAX_TRANSMISSION_SIZE - 1)
+        {
+            chunkLen = MAX_TRANSMISSION_SIZE - 1;
+        }
+        charsWritten += sendChunk(socketFD, ciphertext + charsWritten, chunkLen, charsWritten + chunkLen < dataLen);
     }
     charsRead = readData(socketFD, buffer, sizeof(buffer));                 // Receive server response - ciphertext received msg
     if (strcmp(buffer, "Ciphertext Received") != 0)                         // Confirm server received ciphertext
     {
-        fprintf(stderr, "ERROR: Server did not receive plaintext data\n"); 
+        fprintf(stderr, "ERROR: Server did not receive ciphertext data\n"); 
         exit(2); 
     }
 
     /*-- Send Key Data to Decryption Server --*/
     // Send key data to dec_server
     charsWritten = 0;
-    // continues to write key data to client until ciphertext length reached
-    while (charsWritten < ciphertextLen)
+    // continues to write key data to server until ciphertext length reached
+    while (charsWritten < dataLen)
     {
-        memset(buffer, '\0', sizeof(buffer));                               // Clear out buffer for next line
-        fgets(buffer, sizeof(buffer) - 1, keyFile);                         // Get buffer sized chunk from plaintext
-        buffer[strcspn(buffer, "\n")] = '\0';                               // Remove the trailing \n that fgets adds
-        charsWritten += sendData(socketFD, buffer);
+        chunkLen = dataLen - charsWritten;
+        if (chunkLen > MAX_TRANSMISSION_SIZE - 1)
+        {
+            chunkLen = MAX_TRANSMISSION_SIZE - 1;
+        }
+        charsWritten += sendChunk(socketFD, key + charsWritten, chunkLen, charsWritten + chunkLen < dataLen);
     }
     charsRead = readData(socketFD, buffer, sizeof(buffer));                 // Receive server response - key received msg
     if (strcmp(buffer, "Key Received") != 0)                                // Confirm server received key
@@ -253,19 +424,1049 @@ int main(int argc, char *argv[])
         fprintf(stderr, "ERROR: Server did not receive key data\n"); 
         exit(2); 
     }
-    charsWritten += sendData(socketFD, "Waiting for ciphertext..");
+
+    /*-- Send New Key Data for Rekey Requests --*/
+    if (newKey != NULL)
+    {
+        charsWritten = 0;
+        while (charsWritten < dataLen)
+        {
+            chunkLen = dataLen - charsWritten;
+            if (chunkLen > MAX_TRANSMISSION_SIZE - 1)
+            {
+                chunkLen = MAX_TRANSMISSION_SIZE - 1;
+            }
+            charsWritten += sendChunk(socketFD, newKey + charsWritten, chunkLen, charsWritten + chunkLen < dataLen);
+        }
+        charsRead = readData(socketFD, buffer, sizeof(buffer));             // Receive server response - new key received msg
+        if (strcmp(buffer, "Key Reused") == 0)                              // server keeps track of used keys
+        {
+            fprintf(stderr, "Error: dec_server on port %d rejected new key as already used\n", portNumber);
+            exit(2);
+        }
+        if (strcmp(buffer, "New Key Received") != 0)
+        {
+            fprintf(stderr, "ERROR: Server did not receive new key data\n");
+            exit(2);
+        }
+    }
+    sendData(socketFD, "Waiting for ciphertext..");    
 
     /*-- Receive Plaintext Data from Server --*/
-    memset(plaintext, '\0', sizeof(plaintext));
-    charsRead = 0;
-    // continues to read plaintext data from server until expected data length
-    while (charsRead < ciphertextLen)
+    if (outputFD >= 0)                                                      // reply goes straight to the output file
     {
-        charsRead += readData(socketFD, buffer, sizeof(buffer));
-        strcat(plaintext, buffer);                                         // store plaintext to str
+        receiveToFile(socketFD, outputFD, outOffset, dataLen);
+        close(socketFD);
+        return;
+    }
+    int totalRead = 0;
+    // continues to read plaintext data from server until expected data length, ignoring any trailing padding
+    while (totalRead < dataLen)
+    {
+        charsRead = readData(socketFD, buffer, sizeof(buffer));
+        if (charsRead > dataLen - totalRead)
+        {
+            charsRead = dataLen - totalRead;
+        }
+        memcpy(plaintext + totalRead, buffer, charsRead);                   // stores plain text at its offset
+        totalRead += charsRead;
     }
-    printf("%s\n", plaintext);                                             // prints plaintext with added newline char
 
 	close(socketFD); // Close the socket
+}
+
+// Opens a socket connection to the server on portNumber with Nagle turned off
+int connectServer(int portNumber)
+{
+    struct sockaddr_in serverAddress;
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0)
+    {
+        error("CLIENT: ERROR opening socket");
+    }
+    setupAddressStruct(&serverAddress, portNumber);
+    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+    {
+        fprintf(stderr, "Error: could not contact dec_server on port %d\n", portNumber);
+        exit(2);
+    }
+    int noDelay = 1;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return socketFD;
+}
+
+// Opens a job input file and returns its length - the whole file for binary jobs, or upto the first newline for
+// text jobs, which are checked for valid chars a window at a time rather than read into memory
+long openJobFile(char *fileName, int *fileFD)
+{
+    char filePath[256], window[65536], valid[256] = {0};
+    struct stat fileStat;
+    snprintf(filePath, sizeof(filePath), "./%s", fileName);
+    *fileFD = open(filePath, O_RDONLY);
+    if (*fileFD < 0 || fstat(*fileFD, &fileStat) < 0)
+    {
+        fprintf(stderr,"Invalid File: specified file \'%s\' not found\n", fileName);
+        exit(1);
+    }
+    if (binaryMode)
+    {
+        return fileStat.st_size;
+    }
+
+    for (int i = 0; i < sizeof(validChars); i++)
+    {
+        valid[(unsigned char) validChars[i]] = 1;
+    }
+    long len = 0;
+    ssize_t charsRead;
+    while ((charsRead = pread(*fileFD, window, sizeof(window), len)) > 0)
+    {
+        for (int i = 0; i < charsRead; i++, len++)
+        {
+            if (window[i] == '\n')
+            {
+                return len;
+            }
+            if (!valid[(unsigned char) window[i]])
+            {
+                fprintf(stderr, "Error: %s contains invalid characters.\n", fileName);
+                exit(1);
+            }
+        }
+    }
+    return len;
+}
+
+// Sends len bytes from the start of fileFD straight from the page cache to the socket with sendfile()
+void sendFileData(int socketFD, int fileFD, long len)
+{
+    off_t offset = 0;
+    while (offset < len)
+    {
+        if (sendfile(socketFD, fileFD, &offset, len - offset) <= 0)
+        {
+            error("CLIENT: ERROR sending file to server");
+        }
+    }
+}
+
+// Uploads ciphertext and key files as an async job to the server on portNumber and prints the job ID it hands back
+void submitJob(int portNumber, char *ciphertextName, char *keyName)
+{
+    char buffer[MAX_TRANSMISSION_SIZE];
+    int ciphertextFD, keyFD;
+    long dataLen = openJobFile(ciphertextName, &ciphertextFD);
+    long keyLen = openJobFile(keyName, &keyFD);
+    if (keyLen < dataLen)
+    {
+        fprintf(stderr,"Error: key \'%s\' is too short\n", keyName);
+        exit(1);
+    }
+    if (dataLen == 0 || dataLen > MAX_JOB_SIZE)
+    {
+        fprintf(stderr,"Error: \'%s\' must be 1-%d chars for a job\n", ciphertextName, MAX_JOB_SIZE);
+        exit(1);
+    }
+
+    int socketFD = connectServer(portNumber);
+    sendData(socketFD, binaryMode ? "dec_server binary job" : "dec_server job");
+    readData(socketFD, buffer, sizeof(buffer));
+    if (strcmp(buffer, "denied") == 0)
+    {
+        fprintf(stderr, "Error: server on port %d does not take dec_server jobs\n", portNumber);
+        exit(2);
+    }
+    checkThrottled(buffer, portNumber);
+    sprintf(buffer, "%ld", dataLen);
+    sendData(socketFD, buffer);
+    readData(socketFD, buffer, sizeof(buffer));                             // continue msg
+    checkThrottled(buffer, portNumber);
+
+    sendFileData(socketFD, ciphertextFD, dataLen);
+    readData(socketFD, buffer, sizeof(buffer));
+    if (strcmp(buffer, "Ciphertext Received") != 0)
+    {
+        fprintf(stderr, "ERROR: Server did not receive ciphertext data\n");
+        exit(2);
+    }
+    sendFileData(socketFD, keyFD, dataLen);
+    readData(socketFD, buffer, sizeof(buffer));
+    if (strncmp(buffer, "Job ", 4) != 0)
+    {
+        fprintf(stderr, "ERROR: Server did not accept job\n");
+        exit(2);
+    }
+    printf("%s\n", buffer + 4);                                             // job ID for fetching the result
+    close(socketFD);
+    close(ciphertextFD);
+    close(keyFD);
+}
+
+// Fetches an async job's result from the server on portNumber, polling with backoff while it is still running,
+// and writes it to the output file or stdout
+void fetchJob(int portNumber, char *jobID, char *outputName)
+{
+    char buffer[MAX_TRANSMISSION_SIZE];
+    int socketFD, waitMs = 10;
+    long dataLen;
+    while (1)
+    {
+        socketFD = connectServer(portNumber);
+        snprintf(buffer, sizeof(buffer), "dec_server fetch %s", jobID);
+        sendData(socketFD, buffer);
+        readData(socketFD, buffer, sizeof(buffer));
+        if (strcmp(buffer, "denied") == 0)
+        {
+            fprintf(stderr, "Error: server on port %d does not take dec_server jobs\n", portNumber);
+            exit(2);
+        }
+        checkThrottled(buffer, portNumber);
+        if (sscanf(buffer, "Job Done %ld", &dataLen) == 1)
+        {
+            break;
+        }
+        close(socketFD);
+        if (strcmp(buffer, "Job Pending") != 0)
+        {
+            fprintf(stderr, "Error: no job %s on dec_server port %d\n", jobID, portNumber);
+            exit(1);
+        }
+        usleep(waitMs * 1000);
+        waitMs = waitMs < 1000 ? waitMs * 2 : 1000;
+    }
+    sendData(socketFD, "Waiting for ciphertext..");
+
+    // result goes straight to the output file, or is streamed to stdout a window at a time
+    if (outputName != NULL)
+    {
+        off_t outputLen = dataLen + (binaryMode ? 0 : 1);                   // text output ends in a newline
+        outputFD = open(outputName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (outputFD < 0)
+        {
+            fprintf(stderr,"Error: could not open output file \'%s\'\n", outputName);
+            exit(1);
+        }
+        if (fallocate(outputFD, 0, 0, outputLen) < 0 && ftruncate(outputFD, outputLen) < 0)
+        {
+            error("CLIENT: ERROR sizing output file");
+        }
+        receiveToFile(socketFD, outputFD, 0, dataLen);
+        if (!binaryMode && pwrite(outputFD, "\n", 1, dataLen) != 1)
+        {
+            error("CLIENT: ERROR writing output file");
+        }
+        close(outputFD);
+    }
+    else
+    {
+        char window[65536];
+        long totalRead = 0;
+        while (totalRead < dataLen)
+        {
+            ssize_t charsRead = recv(socketFD, window, sizeof(window), 0);
+            if (charsRead <= 0)
+            {
+                fprintf(stderr, "Error: server closed connection\n");
+                exit(2);
+            }
+            fwrite(window, 1, charsRead, stdout);
+            totalRead += charsRead;
+        }
+        if (!binaryMode)
+        {
+            putchar('\n');
+        }
+    }
+    close(socketFD);
+}
+
+// Connects to the server's shared memory transport on the unix socket at path and maps the channel it hands over
+// as a memfd.  The socket stays open so each side can tell when the other has gone
+struct shmChannel *connectShm(char *path, int *socketFD)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    *socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (*socketFD < 0 || connect(*socketFD, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "Error: could not contact dec_server shared memory transport at %s\n", path);
+        exit(2);
+    }
+
+    // the channel's memfd arrives as SCM_RIGHTS ancillary data
+    int channelFD = -1;
+    char byte, control[CMSG_SPACE(sizeof(int))];
+    struct iovec byteVec = {&byte, 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &byteVec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg;
+    if (recvmsg(*socketFD, &msg, 0) > 0 && (cmsg = CMSG_FIRSTHDR(&msg)) != NULL && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(&channelFD, CMSG_DATA(cmsg), sizeof(int));
+    }
+    struct shmChannel *channel = channelFD < 0 ? MAP_FAILED :
+                                 mmap(NULL, sizeof(struct shmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, channelFD, 0);
+    if (channel == MAP_FAILED || memcmp(channel->magic, "OTPRING1", 8) != 0)
+    {
+        fprintf(stderr, "Error: no shared memory channel from dec_server at %s\n", path);
+        exit(2);
+    }
+    close(channelFD);
+    return channel;
+}
+
+// Waits for the ring's tail to move on from seen, spinning for upto spinBudget checks before sleeping on a futex
+// for upto timeoutMs.  The budget doubles when spinning catches the change and halves when it ends in a sleep.
+// Returns 0 if it timed out
+int shmWait(struct shmRing *ring, uint32_t seen, int *spinBudget, int timeoutMs)
+{
+    for (int i = 0; i < *spinBudget; i++)
+    {
+        if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != seen)
+        {
+            *spinBudget = *spinBudget < SHM_MAX_SPIN ? *spinBudget * 2 : SHM_MAX_SPIN;
+            return 1;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();                                             // ease off the sibling hyperthread while spinning
+#endif
+    }
+    *spinBudget = *spinBudget > SHM_MIN_SPIN ? *spinBudget / 2 : SHM_MIN_SPIN;
+
+    // announce the sleep before the last check so a producer publishing in between knows to wake us
+    struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == seen)
+    {
+        syscall(SYS_futex, &ring->tail, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    }
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != seen;
+}
+
+// Publishes the ring's slots upto newTail, waking the consumer only if it went to sleep
+void shmPublish(struct shmRing *ring, uint32_t newTail)
+{
+    __atomic_store_n(&ring->tail, newTail, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+    {
+        syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// Exits with the matching error if a shared memory request did not go through
+void checkShmReply(struct shmReply *reply, char *path)
+{
+    if (reply->status == SHM_THROTTLED)
+    {
+        fprintf(stderr, "Error: dec_server at %s is throttling requests, retry after %d ms\n", path, reply->len);
+        exit(3);
+    }
+    if (reply->status != SHM_DONE)
+    {
+        fprintf(stderr, "Error: dec_server at %s rejected request\n", path);
+        exit(2);
+    }
+}
+
+// Runs count copies of the request over the shared memory transport at path, keeping the submission ring as full as
+// replies allow, and stores the first reply's plaintext in plaintext
+void runShmRequests(char *path, char *ciphertext, char *key, int dataLen, char *plaintext, int count)
+{
+    int socketFD, spinBudget = SHM_MIN_SPIN;
+    uint32_t submitted = 0, completed = 0;
+    struct timespec start, end;
+    struct shmChannel *channel = connectShm(path, &socketFD);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (completed < count)
+    {
+        // fill every free slot then publish them together
+        uint32_t queued = submitted;
+        while (queued < count && queued - completed < SHM_RING_SLOTS)
+        {
+            struct shmRequest *request = &channel->requests[queued % SHM_RING_SLOTS];
+            request->len = dataLen;
+            request->binary = binaryMode;
+            memcpy(request->ciphertext, ciphertext, dataLen);
+            memcpy(request->key, key, dataLen);
+            queued++;
+        }
+        if (queued != submitted)
+        {
+            submitted = queued;
+            shmPublish(&channel->submit, submitted);
+        }
+
+        // take every reply that is ready, or wait for one
+        uint32_t tail = __atomic_load_n(&channel->complete.tail, __ATOMIC_ACQUIRE);
+        if (tail == completed)
+        {
+            char byte;
+            if (!shmWait(&channel->complete, tail, &spinBudget, 1000) &&
+                recv(socketFD, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)    // server went away
+            {
+                fprintf(stderr, "Error: server closed connection\n");
+                exit(2);
+            }
+            continue;
+        }
+        for (; completed != tail; completed++)
+        {
+            struct shmReply *reply = &channel->replies[completed % SHM_RING_SLOTS];
+            checkShmReply(reply, path);
+            if (completed == 0)
+            {
+                memcpy(plaintext, reply->plaintext, dataLen);
+            }
+        }
+        __atomic_store_n(&channel->complete.head, completed, __ATOMIC_RELEASE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (count > 1)                                                          // report the rate when used as a benchmark
+    {
+        double us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+        fprintf(stderr, "CLIENT: %d requests over shared memory in %.0f us, %.2f us each\n", count, us, us / count);
+    }
+    munmap(channel, sizeof(struct shmChannel));
+    close(socketFD);
+}
+
+// Reads exactly len bytes at offset in fileFD into buffer, returns 0 if the file ends first
+int readFileRange(int fileFD, char *buffer, long offset, long len)
+{
+    long totalRead = 0;
+    while (totalRead < len)
+    {
+        ssize_t charsRead = pread(fileFD, buffer + totalRead, len - totalRead, offset + totalRead);
+        if (charsRead < 0)
+        {
+            error("CLIENT: ERROR reading input file");
+        }
+        if (charsRead == 0)
+        {
+            return 0;
+        }
+        totalRead += charsRead;
+    }
+    return 1;
+}
+
+// Picks how many processes to spread a container's blocks across - like stripes, no more than there are cores or
+// requests the servers take at once
+int chooseBlockWorkers(long numBlocks, int numPorts)
+{
+    long workers = numBlocks;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 0 && workers > cores)
+    {
+        workers = cores;
+    }
+    if (workers > MAX_STRIPES_PER_PORT * numPorts)
+    {
+        workers = MAX_STRIPES_PER_PORT * numPorts;
+    }
+    return workers;
+}
+
+// Decrypts len chars from start in a block container and writes them to the output file, or stdout.  Only the
+// index entries, blocks and pieces of pad covering the range are read and sent, so a range costs the same however
+// large the container is.  Blocks are spread across ports by worker processes which each put their part of the
+// range in place.  A len below 0 runs to the end of the container
+void readContainerRange(int *ports, int numPorts, char *containerName, char *keyName, long start, long len,
+                        char *outputName)
+{
+    struct containerHeader header;
+    char filePath[256];
+    int childStatus, failed = 0;
+    snprintf(filePath, sizeof(filePath), "./%s", containerName);
+    int containerFD = open(filePath, O_RDONLY);
+    if (containerFD < 0)
+    {
+        fprintf(stderr,"Invalid File: specified container \'%s\' not found\n", containerName);
+        exit(1);
+    }
+    if (!readFileRange(containerFD, (char *) &header, 0, sizeof(header)) || memcmp(header.magic, "OTPBLKS1", 8) != 0 ||
+        header.blockSize <= 0 || header.blockSize >= MAX_MSG_SIZE || header.dataLength <= 0 ||
+        header.numBlocks != (header.dataLength + header.blockSize - 1) / header.blockSize)
+    {
+        fprintf(stderr,"Error: \'%s\' is not a block container\n", containerName);
+        exit(1);
+    }
+    if (len < 0)
+    {
+        len = header.dataLength - start;
+    }
+    if (start < 0 || len <= 0 || len > header.dataLength - start)
+    {
+        fprintf(stderr,"Error: range %ld:%ld is outside \'%s\' (%ld chars)\n", start, len, containerName,
+                (long) header.dataLength);
+        exit(1);
+    }
+    binaryMode = header.binary;                                             // the container knows which pad it used
+    snprintf(filePath, sizeof(filePath), "./%s", keyName);
+    int keyFD = open(filePath, O_RDONLY);
+    if (keyFD < 0)
+    {
+        fprintf(stderr,"Invalid File: specified key file \'%s\' not found\n", keyName);
+        exit(1);
+    }
+
+    // read just the index entries for the blocks covering the range
+    long firstBlock = start / header.blockSize;
+    long numBlocks = (start + len - 1) / header.blockSize - firstBlock + 1;
+    struct containerBlock *index = malloc(numBlocks * sizeof(struct containerBlock));
+    if (index == NULL)
+    {
+        error("CLIENT: ERROR allocating container index");
+    }
+    if (!readFileRange(containerFD, (char *) index, sizeof(header) + firstBlock * sizeof(struct containerBlock),
+                       numBlocks * sizeof(struct containerBlock)))
+    {
+        fprintf(stderr,"Error: \'%s\' is truncated\n", containerName);
+        exit(1);
+    }
+
+    // the range is trimmed out of each block by position, so every entry must be exactly its block's size and its
+    // ciphertext must sit after the index and inside the container
+    struct stat containerStat;
+    if (fstat(containerFD, &containerStat) < 0)
+    {
+        error("CLIENT: ERROR reading container size");
+    }
+    int64_t dataStart = sizeof(header) + header.numBlocks * sizeof(struct containerBlock);
+    for (long i = 0; i < numBlocks; i++)
+    {
+        int64_t blockStart = (firstBlock + i) * (int64_t) header.blockSize;
+        int64_t blockLength = header.dataLength - blockStart < header.blockSize ? header.dataLength - blockStart
+                                                                                 : header.blockSize;
+        if (index[i].length != blockLength || index[i].padOffset < 0 || index[i].dataOffset < dataStart ||
+            index[i].dataOffset > containerStat.st_size - blockLength)
+        {
+            fprintf(stderr,"Error: \'%s\' has a bad index entry for block %ld\n", containerName, firstBlock + i);
+            exit(1);
+        }
+    }
+
+    // workers write the range into the output file, or a shared mapping printed once they are done
+    int rangeFD = -1;
+    char *range = NULL;
+    if (outputName != NULL)
+    {
+        off_t outputLen = len + (binaryMode ? 0 : 1);                       // text output ends in a newline
+        rangeFD = open(outputName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (rangeFD < 0)
+        {
+            fprintf(stderr,"Error: could not open output file \'%s\'\n", outputName);
+            exit(1);
+        }
+        if (fallocate(rangeFD, 0, 0, outputLen) < 0 && ftruncate(rangeFD, outputLen) < 0)
+        {
+            error("CLIENT: ERROR sizing output file");
+        }
+    }
+    else
+    {
+        range = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (range == MAP_FAILED)
+        {
+            error("CLIENT: ERROR mapping range buffer");
+        }
+    }
+
+    // each worker takes every workers'th block, flagging itself done once all of them are through
+    int workers = chooseBlockWorkers(numBlocks, numPorts);
+    char *doneFlags = mmap(NULL, workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (doneFlags == MAP_FAILED)
+    {
+        error("CLIENT: ERROR mapping block flags");
+    }
+    memset(doneFlags, 0, workers);
+    for (int w = 0; w < workers; w++)
+    {
+        switch (fork())
+        {
+        case -1:
+            error("CLIENT: ERROR forking block worker");
+
+        case 0:
+        {
+            char *ciphertext = malloc(3 * (header.blockSize + 1));
+            char *key = ciphertext + header.blockSize + 1, *plaintext = key + header.blockSize + 1;
+            if (ciphertext == NULL)
+            {
+                error("CLIENT: ERROR allocating block buffers");
+            }
+            for (long i = w; i < numBlocks; i += workers)
+            {
+                struct containerBlock *block = &index[i];
+                if (!readFileRange(containerFD, ciphertext, block->dataOffset, block->length))
+                {
+                    fprintf(stderr,"Error: \'%s\' is truncated\n", containerName);
+                    exit(1);
+                }
+                int keyRead = readFileRange(keyFD, key, block->padOffset, block->length);
+                if (!binaryMode)
+                {
+                    ciphertext[block->length] = '\0';
+                    key[keyRead ? block->length : 0] = '\0';
+                    checkFileForValidChars(ciphertext, containerName);
+                    checkFileForValidChars(key, keyName);
+                    keyRead = strlen(key) == block->length;                 // the key's newline ends its pad
+                }
+                if (!keyRead)
+                {
+                    fprintf(stderr,"Error: key \'%s\' is too short\n", keyName);
+                    exit(1);
+                }
+                runRequest(ports[(firstBlock + i) % numPorts], ciphertext, key, NULL, block->length, plaintext, 0);
+
+                // keep only the part of the block inside the range
+                long blockStart = (firstBlock + i) * header.blockSize;
+                long from = start > blockStart ? start : blockStart;
+                long to = start + len < blockStart + block->length ? start + len : blockStart + block->length;
+                if (range != NULL)
+                {
+                    memcpy(range + from - start, plaintext + from - blockStart, to - from);
+                }
+                else if (pwrite(rangeFD, plaintext + from - blockStart, to - from, from - start) != to - from)
+                {
+                    error("CLIENT: ERROR writing output file");
+                }
+            }
+            doneFlags[w] = 1;
+            exit(0);
+        }
+
+        default:
+            break;
+        }
+    }
+
+    // wait on all workers and pass along the first failure
+    while (wait(&childStatus) > 0)
+    {
+        if ((!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) && failed == 0)
+        {
+            failed = WIFEXITED(childStatus) ? WEXITSTATUS(childStatus) : 2;
+        }
+    }
+    for (int w = 0; w < workers && failed == 0; w++)
+    {
+        if (doneFlags[w] == 0)
+        {
+            failed = 2;
+        }
+    }
+    munmap(doneFlags, workers);
+    if (failed != 0)
+    {
+        exit(failed);
+    }
+    if (rangeFD >= 0)
+    {
+        if (!binaryMode && pwrite(rangeFD, "\n", 1, len) != 1)
+        {
+            error("CLIENT: ERROR writing output file");
+        }
+        close(rangeFD);
+    }
+    else
+    {
+        fwrite(range, 1, len, stdout);
+        if (!binaryMode)
+        {
+            printf("\n");
+        }
+        munmap(range, len);
+    }
+    close(containerFD);
+    close(keyFD);
+    free(index);
+}
+
+// Splits the request into stripes which are each sent over their own connection (round robin across the given
+// ports), read straight from the ciphertext and key files so inputs of any size can be striped.  Stripes are kept
+// under the server's message size, and spread across worker processes which each write their plaintext into the
+// output file or a shared buffer printed once all of them are through.  newKeyFD is -1 unless re-keying
+void runStripedRequest(int *ports, int numPorts, int ciphertextFD, int keyFD, int newKeyFD, long dataLen)
+{
+    int childStatus, failed = 0;
+    long stripes = chooseStripeCount(dataLen, numPorts);
+    if (stripes < (dataLen + MAX_MSG_SIZE - 2) / (MAX_MSG_SIZE - 1))        // the server takes under MAX_MSG_SIZE
+    {
+        stripes = (dataLen + MAX_MSG_SIZE - 2) / (MAX_MSG_SIZE - 1);
+    }
+    long stripeLen = (dataLen + stripes - 1) / stripes;
+
+    // shared mapping for workers to write results into (unless they go to the output file), followed by one
+    // completion flag per worker
+    int workers = chooseBlockWorkers(stripes, numPorts);
+    long sharedLen = outputFD >= 0 ? 0 : dataLen;
+    char *shared = mmap(NULL, sharedLen + workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        error("CLIENT: ERROR mapping stripe buffer");
+    }
+    char *doneFlags = shared + sharedLen;
+    memset(doneFlags, 0, workers);
+
+    // each worker takes every workers'th stripe, reading just its part of the files
+    for (int w = 0; w < workers; w++)
+    {
+        switch (fork())
+        {
+        case -1:
+            error("CLIENT: ERROR forking stripe");
+
+        case 0:
+        {
+            char *ciphertext = malloc(3 * stripeLen), *key = ciphertext + stripeLen, *newKey = key + stripeLen;
+            if (ciphertext == NULL)
+            {
+                error("CLIENT: ERROR allocating stripe buffers");
+            }
+            for (long i = w; i < stripes; i += workers)
+            {
+                long offset = i * stripeLen;
+                long len = dataLen - offset < stripeLen ? dataLen - offset : stripeLen;
+                if (!readFileRange(ciphertextFD, ciphertext, offset, len) || !readFileRange(keyFD, key, offset, len) ||
+                    (newKeyFD >= 0 && !readFileRange(newKeyFD, newKey, offset, len)))
+                {
+                    fprintf(stderr,"Error: input changed while it was being decrypted\n");
+                    exit(1);
+                }
+                runRequest(ports[i % numPorts], ciphertext, key, newKeyFD >= 0 ? newKey : NULL, len,
+                           outputFD < 0 ? shared + offset : NULL, offset);
+            }
+            doneFlags[w] = 1;                                               // mark worker's stripes as received
+            exit(0);
+        }
+
+        default:
+            break;
+        }
+    }
+
+    // wait on all workers and pass along the first failure
+    while (wait(&childStatus) > 0)
+    {
+        if ((!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) && failed == 0)
+        {
+            failed = WIFEXITED(childStatus) ? WEXITSTATUS(childStatus) : 2;
+        }
+    }
+    for (int w = 0; w < workers && failed == 0; w++)
+    {
+        if (doneFlags[w] == 0)
+        {
+            failed = 2;
+        }
+    }
+    if (failed != 0)
+    {
+        exit(failed);
+    }
+
+    // plaintext is already in order on disk or in the shared buffer
+    if (outputFD >= 0)
+    {
+        if (!binaryMode && pwrite(outputFD, "\n", 1, dataLen) != 1)       // text output ends in a newline
+        {
+            error("CLIENT: ERROR writing output file");
+        }
+        close(outputFD);
+    }
+    else if (fwrite(shared, 1, dataLen, stdout) != dataLen || (!binaryMode && putchar('\n') == EOF))
+    {
+        error("CLIENT: ERROR writing plaintext");
+    }
+    munmap(shared, sharedLen + workers);
+}
+
+// Creates the output file and reserves its blocks up front so replies can be spliced straight into place
+void openOutputFile(char *outputName, long dataLen)
+{
+    off_t outputLen = dataLen + (binaryMode ? 0 : 1);                       // text output ends in a newline
+    outputFD = open(outputName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (outputFD < 0)
+    {
+        fprintf(stderr,"Error: could not open output file \'%s\'\n", outputName);
+        exit(1);
+    }
+    if (fallocate(outputFD, 0, 0, outputLen) < 0 && ftruncate(outputFD, outputLen) < 0)
+    {
+        error("CLIENT: ERROR sizing output file");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int ciphertextLen, keyLen, numPorts, opt;
+    int ports[MAX_PORTS];
+    char ciphertext[MAX_MSG_SIZE];
+    char key[MAX_MSG_SIZE];
+    char newKey[MAX_MSG_SIZE];
+    char *newKeyName = NULL;
+    char *progName = argv[0];
+    char *outputName = NULL;
+    char *fetchID = NULL;
+    int submit = 0;
+    char *shmPath = NULL;
+    int shmCount = 1;
+    char *containerName = NULL;
+    long rangeStart = 0, rangeLen = -1;
+    char plaintext[MAX_MSG_SIZE];
+    char filePath[256];
+
+
+    /*-- Check usage & args --*/
+    while ((opt = getopt(argc, argv, "br:o:aF:m:n:C:x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            binaryMode = 1;                                                 // raw bytes XORed with the key
+            break;
+        case 'r':
+            newKeyName = optarg;                                            // re-key to this key instead of decrypting
+            break;
+        case 'o':
+            outputName = optarg;                                            // write plaintext to this file
+            break;
+        case 'a':
+            submit = 1;                                                     // submit an async job and print its ID
+            break;
+        case 'F':
+            fetchID = optarg;                                               // fetch an async job's plaintext
+            break;
+        case 'm':
+            shmPath = optarg;                                               // use the server's shared memory transport
+            break;
+        case 'n':
+            shmCount = atoi(optarg);                                        // repeat the request over shared memory
+            break;
+        case 'C':
+            containerName = optarg;                                         // decrypt from an indexed block container
+            break;
+        case 'x':
+            if (sscanf(optarg, "%ld:%ld", &rangeStart, &rangeLen) < 1)      // range of the container, start[:len]
+            {
+                rangeStart = -1;
+            }
+            break;
+        default:
+            fprintf(stderr,"USAGE: \'%s\' [-b] [-r newkey] [-o outfile] ciphertext key port[,port...]\n"
+                           "       \'%s\' [-b] -a ciphertext key port | [-b] [-o outfile] -F jobid port\n"
+                           "       \'%s\' [-b] [-o outfile] -m ringsocket [-n count] ciphertext key\n"
+                           "       \'%s\' -C container [-x start[:len]] [-o outfile] key port[,port...]\n", progName, progName, progName,
+                           progName);
+            exit(1);
+        }
+    }
+    argv += optind - 1;                                                     // positional args follow the options
+    argc -= optind - 1;
+    if (fetchID != NULL && argc >= 2)                                       // job results are fetched by ID alone
+    {
+        fetchJob(atoi(argv[1]), fetchID, outputName);
+        return 0;
+    }
+    // rekeys are not run as jobs, over shared memory or on containers
+    if (argc < (shmPath != NULL || containerName != NULL ? 3 : 4) || fetchID != NULL || shmCount < 1 ||
+        ((submit || shmPath != NULL || containerName != NULL) && newKeyName != NULL) || (submit && shmPath != NULL) ||
+        (containerName != NULL && (submit || shmPath != NULL)))
+    { 
+        fprintf(stderr,"USAGE: \'%s\' [-b] [-r newkey] [-o outfile] ciphertext key port[,port...]\n"
+                       "       \'%s\' [-b] -a ciphertext key port | [-b] [-o outfile] -F jobid port\n"
+                       "       \'%s\' [-b] [-o outfile] -m ringsocket [-n count] ciphertext key\n"
+                       "       \'%s\' -C container [-x start[:len]] [-o outfile] key port[,port...]\n", progName, progName, progName,
+                       progName); 
+        exit(0); 
+    }
+    if (submit)                                                             // job files are streamed, not loaded
+    {
+        submitJob(atoi(argv[3]), argv[1], argv[2]);
+        return 0;
+    }
+    if (containerName != NULL)                                              // containers are read a block at a time
+    {
+        numPorts = parsePorts(argv[2], ports, MAX_PORTS);
+        if (numPorts == 0)
+        {
+            fprintf(stderr,"Error: no port given\n");
+            exit(1);
+        }
+        readContainerRange(ports, numPorts, containerName, argv[1], rangeStart, rangeLen, outputName);
+        return 0;
+    }
+
+    // payloads large enough to stripe are read a stripe at a time from the files rather than loaded whole
+    struct stat ciphertextStat;
+    snprintf(filePath, sizeof(filePath), "./%s", argv[1]);
+    if (shmPath == NULL && stat(filePath, &ciphertextStat) == 0 && ciphertextStat.st_size >= 2 * STRIPE_MIN_SIZE)
+    {
+        int ciphertextFD, keyFD, newKeyFD = -1;
+        numPorts = parsePorts(argv[3], ports, MAX_PORTS);
+        if (numPorts == 0)
+        {
+            fprintf(stderr,"Error: no port given\n");
+            exit(1);
+        }
+        long dataLen = openJobFile(argv[1], &ciphertextFD);
+        if (openJobFile(argv[2], &keyFD) < dataLen)
+        {
+            fprintf(stderr,"Error: key \'%s\' is too short\n", argv[2]);
+            exit(1);
+        }
+        if (newKeyName != NULL && openJobFile(newKeyName, &newKeyFD) < dataLen)
+        {
+            fprintf(stderr,"Error: key \'%s\' is too short\n", newKeyName);
+            exit(1);
+        }
+        if (outputName != NULL)
+        {
+            openOutputFile(outputName, dataLen);
+        }
+        runStripedRequest(ports, numPorts, ciphertextFD, keyFD, newKeyFD, dataLen);
+        return 0;
+    }
+
+    /*-- Check Ciphertext and Key inputs --*/
+    // Clears all string storage for input
+    memset(filePath, '\0', sizeof(filePath));   
+    memset(ciphertext, '\0', sizeof(ciphertext));                           
+    memset(key, '\0', sizeof(key));                           
+
+    if (binaryMode)                                                         // binary files take any bytes
+    {
+        ciphertextLen = readBinaryFile(argv[1], ciphertext, sizeof(ciphertext) - 1);
+        keyLen = readBinaryFile(argv[2], key, sizeof(key) - 1);
+    }
+    else
+    {
+        // Open specified ciphertext file text for read only
+        strcpy(filePath, "./");                                             // generate filepath
+        strcat(filePath, argv[1]); 
+        FILE *ciphertextFile = fopen(filePath, "r");
+        if (ciphertextFile == NULL)                                         // error handling for invalid file
+        {
+            fprintf(stderr,"Invalid File: specified ciphertext file \'%s\' not found\n", argv[1]); 
+            exit(1);
+        }
+
+        // Check if Ciphertext file has valid chars and store file size
+        fgets(ciphertext, sizeof(ciphertext) - 1, ciphertextFile);          // stores file contents to string
+        fclose(ciphertextFile);
+        checkFileForValidChars(ciphertext, argv[1]);
+        ciphertextLen = strlen(ciphertext);                                 // store ciphertext len
+
+        // Open specified key file text for read only
+        memset(filePath, '\0', sizeof(filePath));                           // clear filepath variable                
+        strcpy(filePath, "./");                                             // generate filepath
+        strcat(filePath, argv[2]); 
+        FILE *keyFile = fopen(filePath, "r");
+        if (keyFile == NULL)                                                // error handling for invalid file
+        {
+            fprintf(stderr,"Invalid File: specified key file %s not found\n", argv[2]);
+            exit(1);
+        }
+
+        // Check if key file has valid chars and store file size
+        fgets(key, sizeof(key) - 1, keyFile);                               // stores file contents to string
+        fclose(keyFile);
+        checkFileForValidChars(key, argv[2]);
+        keyLen = strlen(key);                                               // store key len
+    }
+
+    // check if ciphertext is greater than key size, throw error and exit if true
+    if(keyLen < ciphertextLen){ 
+        fprintf(stderr,"Error: key \'%s\' is too short\n", argv[2]);
+        exit(1);
+	}
+
+    // Open, validate and check length of the new key file for rekey requests
+    if (newKeyName != NULL && binaryMode)
+    {
+        if (readBinaryFile(newKeyName, newKey, sizeof(newKey) - 1) < ciphertextLen)
+        {
+            fprintf(stderr,"Error: key \'%s\' is too short\n", newKeyName);
+            exit(1);
+        }
+    }
+    else if (newKeyName != NULL)
+    {
+        memset(filePath, '\0', sizeof(filePath));
+        strcpy(filePath, "./");
+        strcat(filePath, newKeyName);
+        FILE *newKeyFile = fopen(filePath, "r");
+        if (newKeyFile == NULL)
+        {
+            fprintf(stderr,"Invalid File: specified key file %s not found\n", newKeyName);
+            exit(1);
+        }
+        fgets(newKey, sizeof(newKey) - 1, newKeyFile);
+        fclose(newKeyFile);
+        checkFileForValidChars(newKey, newKeyName);
+        if ((int)strlen(newKey) < ciphertextLen)
+        {
+            fprintf(stderr,"Error: key \'%s\' is too short\n", newKeyName);
+            exit(1);
+        }
+    }
+
+    /*-- Send Decryption Request(s) --*/
+    if (shmPath != NULL && ciphertextLen > SHM_MAX_DATA)
+    {
+        fprintf(stderr,"Error: \'%s\' is too large for the shared memory transport, use a port\n", argv[1]);
+        exit(1);
+    }
+    numPorts = shmPath != NULL ? 1 : parsePorts(argv[3], ports, MAX_PORTS);
+    if (numPorts == 0)
+    {
+        fprintf(stderr,"Error: no port given\n");
+        exit(1);
+    }
+    if (outputName != NULL)
+    {
+        openOutputFile(outputName, ciphertextLen);
+    }
+
+    memset(plaintext, '\0', sizeof(plaintext));
+    if (shmPath != NULL)                                                    // co-located server, no socket per request
+    {
+        runShmRequests(shmPath, ciphertext, key, ciphertextLen, plaintext, shmCount);
+        if (outputFD >= 0 && pwrite(outputFD, plaintext, ciphertextLen, 0) != ciphertextLen)
+        {
+            error("CLIENT: ERROR writing output file");
+        }
+    }
+    else                                                                    // small payloads go over a single connection
+    {
+        runRequest(ports[0], ciphertext, key, newKeyName ? newKey : NULL, ciphertextLen, plaintext, 0);
+    }
+    if (outputFD >= 0)
+    {
+        // reply is already on disk, add its newline
+        if (!binaryMode && pwrite(outputFD, "\n", 1, ciphertextLen) != 1)
+        {
+            error("CLIENT: ERROR writing output file");
+        }
+        close(outputFD);
+    }
+    else if (binaryMode)
+    {
+        fwrite(plaintext, 1, ciphertextLen, stdout);                        // binary plaintext is written as is
+    }
+    else
+    {
+        printf("%s\n", plaintext);                                          // prints plaintext with added newline char
+    }
+
 	return 0;
-}
\ No newline at end of file
+}
@@ -10,6 +10,27 @@
 *                right service and sends all relevant data.  It then waits to receive a ciphertext response which
 *                it prints to stdout (which can be redirected).
 *
+*                Larger plaintexts are split into stripes which are each sent over their own connection, spread
+*                across one or more server ports (ie "5001,5002"), and reassembled in order.  Stripes are read
+*                straight from the files and kept under the server's message size, so plaintexts of any size can
+*                be sent.
+*
+*                With -a the files are submitted as an async job of upto 1GB, streamed to the server with sendfile()
+*                instead of being loaded, and the job ID is printed.  -F fetches the job's ciphertext by that ID,
+*                waiting while the job is still running.
+*
+*                With -C the ciphertext is written to an indexed block container instead: fixed size blocks, each
+*                encrypted as its own request, behind an index recording where each block and its pad (from -k on
+*                in the key) start.  dec_client can then decrypt any range of it by fetching only the blocks covering
+*                the range.  Plaintexts of any size are streamed through a block at a time.
+*
+*                With -m the request goes to a co-located enc_server over its shared memory transport instead of a
+*                socket.  Requests of upto 4096 chars are written into rings in a channel the server hands over on a
+*                unix socket.  -n repeats the request that many times, keeping the rings full, and reports the rate.
+*
+*                With -b the files are treated as raw bytes for the binary pad (plaintext XOR key) and the
+*                ciphertext is written out as raw bytes without a trailing newline.
+*
 */
 
 #define _GNU_SOURCE
@@ -19,7 +40,19 @@
 #include <string.h>
 #include <sys/types.h>  // ssize_t
 #include <sys/socket.h> // send(),recv()
+#include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_NODELAY
 #include <netdb.h>      // gethostbyname()
+#include <sys/mman.h>   // mmap()
+#include <sys/wait.h>   // wait()
+#include <fcntl.h>      // open(), splice(), fallocate()
+#include <sys/stat.h>   // fstat()
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <time.h>
 
 
 // Declare Global Resources 
@@ -27,6 +60,70 @@ static const char *HOSTNAME = "localhost";                              // hostn
 static const int MAX_MSG_SIZE = 100000;                                 // maximum size of data to be sent
 static const int MAX_TRANSMISSION_SIZE = 1024;                          // maximum size of data for transmission to server
 static const char validChars[27] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";       // set of all valid input characters A-Z and SPACE
+static const int STRIPE_MIN_SIZE = 16384;                               // minimum size of data per stripe connection
+static const int MAX_STRIPES_PER_PORT = 5;                              // servers handle upto 5 concurrent requests
+static const int MAX_JOB_SIZE = 1 << 30;                                // maximum size of data for an async job
+static const int CONTAINER_BLOCK_SIZE = 65536;                          // chars per block of a block container
+#define SHM_RING_SLOTS 64                                               // requests in flight over shared memory
+#define SHM_MAX_DATA 4096                                               // largest request taken over shared memory
+static const int SHM_MIN_SPIN = 64;                                     // bounds on ring checks made before sleeping on a futex
+static const int SHM_MAX_SPIN = 65536;
+#define MAX_PORTS 16                                                    // maximum number of server ports to stripe across
+static int binaryMode = 0;                                              // set by -b, requests use the binary XOR pad
+static int outputFD = -1;                                               // set by -o, replies are spliced straight into this file
+
+// Outcome of a shared memory request
+enum shmStatus { SHM_DONE, SHM_INVALID, SHM_THROTTLED, SHM_KEY_REUSED };
+
+struct shmRequest
+{
+    int len;                                         // chars of plaintext and key
+    int binary;                                      // 1 for the binary pad
+    char plaintext[SHM_MAX_DATA];
+    char key[SHM_MAX_DATA];
+};
+
+struct shmReply
+{
+    int status;                                      // shmStatus of the request
+    int len;                                         // chars of ciphertext, or ms to wait for SHM_THROTTLED
+    char ciphertext[SHM_MAX_DATA];
+};
+
+// Producer and consumer indexes count up forever and are masked into slots, each on its own cache line
+struct shmRing
+{
+    uint32_t tail __attribute__((aligned(64)));      // slots published by the producer, also the futex word
+    uint32_t sleeping;                               // 1 while the consumer is asleep on tail
+    uint32_t head __attribute__((aligned(64)));      // slots taken by the consumer
+};
+
+struct shmChannel
+{
+    char magic[8];                                   // "OTPRING1", checked by clients
+    struct shmRing submit __attribute__((aligned(64)));
+    struct shmRing complete;
+    struct shmRequest requests[SHM_RING_SLOTS];
+    struct shmReply replies[SHM_RING_SLOTS];
+};
+
+// A block container (-C) holds a ciphertext as fixed size blocks behind an index, so any range can be decrypted by
+// fetching just the blocks covering it. Layout is the header, then an entry per block, then the blocks in order
+struct containerHeader
+{
+    char magic[8];                                   // "OTPBLKS1"
+    int32_t binary;                                  // 1 if the blocks use the binary pad
+    int32_t blockSize;                               // chars per block, the last block may be shorter
+    int64_t dataLength;                              // total chars of ciphertext
+    int64_t numBlocks;
+};
+
+struct containerBlock
+{
+    int64_t dataOffset;                              // where the block's ciphertext starts in the container
+    int64_t padOffset;                               // where the block's pad starts in the key
+    int64_t length;                                  // chars in the block
+};
 
 // Error function used for reporting issues with errno
 void error(const char *msg)
@@ -73,14 +170,27 @@ int sendData(int socketFD, char *msg)
     return charsWritten;
 }
 
+// Send upto len bytes of data via provided socket.  If more is set further chunks follow straight after, so the
+// kernel holds partial segments back (MSG_MORE) until the last chunk flushes them
+int sendChunk(int socketFD, char *data, int len, int more)
+{
+    int charsWritten = send(socketFD, data, len, more ? MSG_MORE : 0);     // Sends data to a socket File Descriptor
+    if (charsWritten < 0)                                                   // Error check sent data
+    {                                          
+        error("CLIENT: ERROR writing to socket");
+    }
+    return charsWritten;
+}
+
 // Read data via provided socket
 int readData(int socketFD, char *buffer, int bufferLen)
 {
     memset(buffer, '\0', bufferLen);                                        // Clear out buffers and charsRead for next recv
-    int charsRead = 0;
-    while (charsRead == 0)                                                  // Wait for next available recv data
+    int charsRead = recv(socketFD, buffer, bufferLen - 1, 0);               // Read the server's message from the socket
+    if (charsRead == 0)                                                     // Server hung up before finishing request
     {
-        charsRead = recv(socketFD, buffer, bufferLen - 1, 0);               // Read the client's message from the socket
+        fprintf(stderr, "Error: server closed connection\n");
+        exit(2);
     }
     if (charsRead < 0)                                                      // Error check received data
     {                                          
@@ -93,6 +203,27 @@ int readData(int socketFD, char *buffer, int bufferLen)
     return charsRead;
 }
 
+// Reads a whole binary input file (any bytes, no alphabet check) into buffer and returns its length
+int readBinaryFile(char *fileName, char *buffer, int bufferLen)
+{
+    char filePath[256];
+    snprintf(filePath, sizeof(filePath), "./%s", fileName);
+    FILE *file = fopen(filePath, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr,"Invalid File: specified file \'%s\' not found\n", fileName);
+        exit(1);
+    }
+    int len = fread(buffer, 1, bufferLen, file);
+    if (len == bufferLen && fgetc(file) != EOF)                            // must leave room for the full request
+    {
+        fprintf(stderr,"Error: \'%s\' is too large\n", fileName);
+        exit(1);
+    }
+    fclose(file);
+    return len;
+}
+
 // Check if input file contains only valid chars via validChar mapping
 void checkFileForValidChars(char *input, char *fileName)
 {
@@ -119,68 +250,95 @@ void checkFileForValidChars(char *input, char *fileName)
     }
 }
 
-int main(int argc, char *argv[])
+// Check if the server throttled the request and report how long to wait before retrying
+void checkThrottled(char *response, int portNumber)
 {
-    int socketFD, portNumber, charsWritten, charsRead, plaintextLen, keyLen;
-    struct sockaddr_in serverAddress;
-    char buffer[MAX_TRANSMISSION_SIZE];
-    char plaintext[MAX_MSG_SIZE];
-    char key[MAX_MSG_SIZE];
-    char ciphertext[MAX_MSG_SIZE];
-    char filePath[256];
-
-
-    /*-- Check usage & args --*/
-    if (argc < 4) 
-    { 
-        fprintf(stderr,"USAGE: \'%s\' plaintext key port\n", argv[0]); 
-        exit(0); 
+    int retryMs;
+    if (sscanf(response, "throttled %d", &retryMs) == 1)
+    {
+        fprintf(stderr, "Error: enc_server on port %d is throttling requests, retry after %d ms\n", portNumber, retryMs);
+        exit(3);
     }
+}
 
-    /*-- Check Plaintext and Key inputs --*/
-    // Clears all string storage for input
-    memset(filePath, '\0', sizeof(filePath));   
-    memset(plaintext, '\0', sizeof(plaintext));                           
-    memset(key, '\0', sizeof(key));                           
-
-    // Open specified plaintext file text for read only
-    strcpy(filePath, "./");                                                 // generate filepath
-    strcat(filePath, argv[1]); 
-    FILE *plaintextFile = fopen(filePath, "r");
-    if (plaintextFile == NULL)                                              // error handling for invalid file
+// Parse a comma separated list of ports (ie "5001,5002") into ports array, returns number of ports found
+int parsePorts(char *portList, int *ports, int maxPorts)
+{
+    int numPorts = 0;
+    char *savePtr;
+    char *token = strtok_r(portList, ",", &savePtr);
+    while (token != NULL && numPorts < maxPorts)
     {
-        fprintf(stderr,"Invalid File: specified plaintext file \'%s\' not found\n", argv[1]); 
-        exit(1);
+        ports[numPorts++] = atoi(token);
+        token = strtok_r(NULL, ",", &savePtr);
     }
+    return numPorts;
+}
 
-    // Check if Plaintext file has valid chars and store file size
-    fgets(plaintext, sizeof(plaintext) - 1, plaintextFile);                 // stores file contents to string
-    fseek(plaintextFile, 0, SEEK_SET);                                      // reset pointer for next use
-    checkFileForValidChars(plaintext, argv[1]);
-    plaintextLen = strlen(plaintext);                                       // store plaintext len
-
-    // Open specified key file text for read only
-    memset(filePath, '\0', sizeof(filePath));                               // clear filepath variable                
-    strcpy(filePath, "./");                                                 // generate filepath
-    strcat(filePath, argv[2]); 
-    FILE *keyFile = fopen(filePath, "r");
-    if (keyFile == NULL)                                                    // error handling for invalid file
+// Picks the number of stripes to split a payload into based on its size, available cores and server ports
+int chooseStripeCount(long dataLen, int numPorts)
+{
+    long stripes = dataLen / STRIPE_MIN_SIZE;                              // only stripe once each stripe is worth a connection
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);                             // no point in more stripes than cores
+    if (cores > 0 && stripes > cores)
     {
-        fprintf(stderr,"Invalid File: specified key file %s not found\n", argv[2]);
-        exit(1);
+        stripes = cores;
+    }
+    if (stripes > MAX_STRIPES_PER_PORT * numPorts)                          // each server only handles 5 requests at a time
+    {
+        stripes = MAX_STRIPES_PER_PORT * numPorts;
+    }
+    if (stripes < 1)
+    {
+        stripes = 1;
     }
+    return stripes;
+}
 
-    // Check if key file has valid chars and store file size
-    fgets(key, sizeof(key) - 1, keyFile);                                   // stores file contents to string
-    fseek(keyFile, 0, SEEK_SET);                                            // reset pointer for next use
-    checkFileForValidChars(key, argv[2]);
-    keyLen = strlen(key);                                                   // store key len
+// Receives len chars of reply from the socket straight into outFD at offset with splice() through a pipe, so the
+// reply is written to disk without ever being copied into userspace
+void receiveToFile(int socketFD, int outFD, off_t offset, int len)
+{
+    int pipeFDs[2];
+    loff_t fileOffset = offset;                                             // explicit offset so stripes can share outFD
+    if (pipe(pipeFDs) < 0)
+    {
+        error("CLIENT: ERROR creating pipe");
+    }
+    while (len > 0)
+    {
+        ssize_t charsIn = splice(socketFD, NULL, pipeFDs[1], NULL, len, SPLICE_F_MOVE);
+        if (charsIn < 0)
+        {
+            error("CLIENT: ERROR splicing from socket");
+        }
+        if (charsIn == 0)                                                   // Server hung up before finishing request
+        {
+            fprintf(stderr, "Error: server closed connection\n");
+            exit(2);
+        }
+        len -= charsIn;
+        while (charsIn > 0)                                                 // drain the pipe into the file
+        {
+            ssize_t charsOut = splice(pipeFDs[0], NULL, outFD, &fileOffset, charsIn, SPLICE_F_MOVE);
+            if (charsOut <= 0)
+            {
+                error("CLIENT: ERROR splicing to output file");
+            }
+            charsIn -= charsOut;
+        }
+    }
+    close(pipeFDs[0]);
+    close(pipeFDs[1]);
+}
 
-    // check if plaintext is greater than key size, throw error and exit if true
-    if(keyLen < plaintextLen){ 
-        fprintf(stderr,"Error: key \'%s\' is too short\n", argv[2]);
-        exit(1);
-	}
+// Runs a full encryption request for dataLen chars of plaintext/key against the server on portNumber and
+// stores the resulting ciphertext in ciphertext (exactly dataLen chars), or at outOffset in the output file
+void runRequest(int portNumber, char *plaintext, char *key, int dataLen, char *ciphertext, off_t outOffset)
+{
+    int socketFD, charsWritten, charsRead, chunkLen;
+    struct sockaddr_in serverAddress;
+    char buffer[MAX_TRANSMISSION_SIZE];
 
     /*-- Create and Validate Encryption Socket Connection --*/
     // Create a socket
@@ -188,46 +346,52 @@ int main(int argc, char *argv[])
     if (socketFD < 0)
     {
         error("CLIENT: ERROR opening socket");
-		fprintf(stderr, "Error: could not contact enc_server on port %d\n", atoi(argv[3]));
+		fprintf(stderr, "Error: could not contact enc_server on port %d\n", portNumber);
         exit(2);
     }
 
     // Set up the server address struct
-    setupAddressStruct(&serverAddress, atoi(argv[3]));
+    setupAddressStruct(&serverAddress, portNumber);
 
     // Connect to server
     if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
     {
         error("CLIENT: ERROR connecting to server");
-		fprintf(stderr, "Error: could not contact enc_server on port %d\n", atoi(argv[3]));
+		fprintf(stderr, "Error: could not contact enc_server on port %d\n", portNumber);
         exit(2);
     }
+    int noDelay = 1;                                                        // MSG_MORE marks flush points instead of Nagle
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
 
     /*-- Validate Socket Connection Is For Right Encryption Service --*/
-    char* checkMsg = "enc_server";                                          // Send request type to server
+    char* checkMsg = binaryMode ? "enc_server binary" : "enc_server";       // Send request type to server
     sendData(socketFD, checkMsg);                                                               
     charsRead = readData(socketFD, buffer, sizeof(buffer));                 // Receive server response - accepted or denied
     if(strcmp(buffer, "denied") == 0){                                      // Check if server affirms correct connection type
-		fprintf(stderr, "Error: enc_client cannot use dec_server on port %d\n", atoi(argv[3]));
+		fprintf(stderr, "Error: enc_client cannot use dec_server on port %d\n", portNumber);
 		exit(2);    // if invalid, else exits
 	}
+    checkThrottled(buffer, portNumber);                                     // server may ask client to back off
 
     /*-- Send Plaintext Data to Encryption Server --*/
     // Send data length
     memset(buffer, '\0', sizeof(buffer));                                   // Clear out buffers and charsread for next send
-	sprintf(buffer, "%d", plaintextLen);
+	sprintf(buffer, "%d", dataLen);
     sendData(socketFD, buffer);                                             // Send plaintext length to server
     charsRead = readData(socketFD, buffer, sizeof(buffer));                 // Receive server response - continue msg
+    checkThrottled(buffer, portNumber);
 
     // Send plaintext data to enc_server
     charsWritten = 0;
-    // continues to write plaintext data to client until plaintext length reached
-    while (charsWritten < plaintextLen)
+    // continues to write plaintext data to server in transmission sized chunks until plaintext length reached
+    while (charsWritten < dataLen)
     {
-        memset(buffer, '\0', sizeof(buffer));                               // Clear out buffer for next line
-        fgets(buffer, sizeof(buffer) - 1, plaintextFile);                   // Get buffer sized chunk from plaintext
-        buffer[strcspn(buffer, "\n")] = '\0';                               // Remove the trailing \n that fgets adds
-        charsWritten += sendData(socketFD, buffer);
+        chunkLen = dataLen - charsWritten;
+        if (chunkLen > MAX_TRANSMISSION_SIZE - 1)
+        {
+            chunkLen = MAX_TRANSMISSION_SIZE - 1;
+        }
+        charsWritten += sendChunk(socketFD, plaintext + charsWritten, chunkLen, charsWritten + chunkLen < dataLen);
     }
     charsRead = readData(socketFD, buffer, sizeof(buffer));                 // Receive server response - plaintext received msg
     if (strcmp(buffer, "Plaintext Received") != 0)                          // Confirm server received plaintext
@@ -239,33 +403,925 @@ int main(int argc, char *argv[])
     /*-- Send Key Data to Encryption Server --*/
     // Send key data to enc_server
     charsWritten = 0;
-    // continues to write key data to client until plaintext length reached
-    while (charsWritten < plaintextLen)
+    // continues to write key data to server until plaintext length reached
+    while (charsWritten < dataLen)
     {
-        memset(buffer, '\0', sizeof(buffer));                               // Clear out buffer for next line
-        fgets(buffer, sizeof(buffer) - 1, keyFile);                         // Get buffer sized chunk from plaintext
-        buffer[strcspn(buffer, "\n")] = '\0';                               // Remove the trailing \n that fgets adds
-        charsWritten += sendData(socketFD, buffer);
+        chunkLen = dataLen - charsWritten;
+        if (chunkLen > MAX_TRANSMISSION_SIZE - 1)
+        {
+            chunkLen = MAX_TRANSMISSION_SIZE - 1;
+        }
+        charsWritten += sendChunk(socketFD, key + charsWritten, chunkLen, charsWritten + chunkLen < dataLen);
     }
     charsRead = readData(socketFD, buffer, sizeof(buffer));                 // Receive server response - key received msg
+    if (strcmp(buffer, "Key Reused") == 0)                                  // server keeps track of used keys
+    {
+        fprintf(stderr, "Error: enc_server on port %d rejected key as already used\n", portNumber);
+        exit(2);
+    }
     if (strcmp(buffer, "Key Received") != 0)                                // Confirm server received key
     {
         fprintf(stderr, "ERROR: Server did not receive key data\n"); 
         exit(2); 
     }
-    charsWritten += sendData(socketFD, "Waiting for ciphertext..");    
+    sendData(socketFD, "Waiting for ciphertext..");    
 
     /*-- Receive Ciphertext Data from Server --*/
-    memset(ciphertext, '\0', sizeof(ciphertext));
-    charsRead = 0;
-    // continues to read cipher data from server until expected data length
-    while (charsRead < plaintextLen)
+    if (outputFD >= 0)                                                      // reply goes straight to the output file
+    {
+        receiveToFile(socketFD, outputFD, outOffset, dataLen);
+        close(socketFD);
+        return;
+    }
+    int totalRead = 0;
+    // continues to read cipher data from server until expected data length, ignoring any trailing padding
+    while (totalRead < dataLen)
     {
-        charsRead += readData(socketFD, buffer, sizeof(buffer));
-        strcat(ciphertext, buffer);                                         // stores cipher text to ciphertext str
+        charsRead = readData(socketFD, buffer, sizeof(buffer));
+        if (charsRead > dataLen - totalRead)
+        {
+            charsRead = dataLen - totalRead;
+        }
+        memcpy(ciphertext + totalRead, buffer, charsRead);                  // stores cipher text at its offset
+        totalRead += charsRead;
     }
-    printf("%s\n", ciphertext);                                             // prints ciphertext with added newline char
 
 	close(socketFD); // Close the socket
+}
+
+// Opens a socket connection to the server on portNumber with Nagle turned off
+int connectServer(int portNumber)
+{
+    struct sockaddr_in serverAddress;
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0)
+    {
+        error("CLIENT: ERROR opening socket");
+    }
+    setupAddressStruct(&serverAddress, portNumber);
+    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+    {
+        fprintf(stderr, "Error: could not contact enc_server on port %d\n", portNumber);
+        exit(2);
+    }
+    int noDelay = 1;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return socketFD;
+}
+
+// Opens a job input file and returns its length - the whole file for binary jobs, or upto the first newline for
+// text jobs, which are checked for valid chars a window at a time rather than read into memory
+long openJobFile(char *fileName, int *fileFD)
+{
+    char filePath[256], window[65536], valid[256] = {0};
+    struct stat fileStat;
+    snprintf(filePath, sizeof(filePath), "./%s", fileName);
+    *fileFD = open(filePath, O_RDONLY);
+    if (*fileFD < 0 || fstat(*fileFD, &fileStat) < 0)
+    {
+        fprintf(stderr,"Invalid File: specified file \'%s\' not found\n", fileName);
+        exit(1);
+    }
+    if (binaryMode)
+    {
+        return fileStat.st_size;
+    }
+
+    for (int i = 0; i < sizeof(validChars); i++)
+    {
+        valid[(unsigned char) validChars[i]] = 1;
+    }
+    long len = 0;
+    ssize_t charsRead;
+    while ((charsRead = pread(*fileFD, window, sizeof(window), len)) > 0)
+    {
+        for (int i = 0; i < charsRead; i++, len++)
+        {
+            if (window[i] == '\n')
+            {
+                return len;
+            }
+            if (!valid[(unsigned char) window[i]])
+            {
+                fprintf(stderr, "Error: %s contains invalid characters.\n", fileName);
+                exit(1);
+            }
+        }
+    }
+    return len;
+}
+
+// Sends len bytes from the start of fileFD straight from the page cache to the socket with sendfile()
+void sendFileData(int socketFD, int fileFD, long len)
+{
+    off_t offset = 0;
+    while (offset < len)
+    {
+        if (sendfile(socketFD, fileFD, &offset, len - offset) <= 0)
+        {
+            error("CLIENT: ERROR sending file to server");
+        }
+    }
+}
+
+// Uploads plaintext and key files as an async job to the server on portNumber and prints the job ID it hands back
+void submitJob(int portNumber, char *plaintextName, char *keyName)
+{
+    char buffer[MAX_TRANSMISSION_SIZE];
+    int plaintextFD, keyFD;
+    long dataLen = openJobFile(plaintextName, &plaintextFD);
+    long keyLen = openJobFile(keyName, &keyFD);
+    if (keyLen < dataLen)
+    {
+        fprintf(stderr,"Error: key \'%s\' is too short\n", keyName);
+        exit(1);
+    }
+    if (dataLen == 0 || dataLen > MAX_JOB_SIZE)
+    {
+        fprintf(stderr,"Error: \'%s\' must be 1-%d chars for a job\n", plaintextName, MAX_JOB_SIZE);
+        exit(1);
+    }
+
+    int socketFD = connectServer(portNumber);
+    sendData(socketFD, binaryMode ? "enc_server binary job" : "enc_server job");
+    readData(socketFD, buffer, sizeof(buffer));
+    if (strcmp(buffer, "denied") == 0)
+    {
+        fprintf(stderr, "Error: server on port %d does not take enc_server jobs\n", portNumber);
+        exit(2);
+    }
+    checkThrottled(buffer, portNumber);
+    sprintf(buffer, "%ld", dataLen);
+    sendData(socketFD, buffer);
+    readData(socketFD, buffer, sizeof(buffer));                             // continue msg
+    checkThrottled(buffer, portNumber);
+
+    sendFileData(socketFD, plaintextFD, dataLen);
+    readData(socketFD, buffer, sizeof(buffer));
+    if (strcmp(buffer, "Plaintext Received") != 0)
+    {
+        fprintf(stderr, "ERROR: Server did not receive plaintext data\n");
+        exit(2);
+    }
+    sendFileData(socketFD, keyFD, dataLen);
+    readData(socketFD, buffer, sizeof(buffer));
+    if (strcmp(buffer, "Key Reused") == 0)
+    {
+        fprintf(stderr, "Error: enc_server on port %d rejected key as already used\n", portNumber);
+        exit(2);
+    }
+    if (strncmp(buffer, "Job ", 4) != 0)
+    {
+        fprintf(stderr, "ERROR: Server did not accept job\n");
+        exit(2);
+    }
+    printf("%s\n", buffer + 4);                                             // job ID for fetching the result
+    close(socketFD);
+    close(plaintextFD);
+    close(keyFD);
+}
+
+// Fetches an async job's result from the server on portNumber, polling with backoff while it is still running,
+// and writes it to the output file or stdout
+void fetchJob(int portNumber, char *jobID, char *outputName)
+{
+    char buffer[MAX_TRANSMISSION_SIZE];
+    int socketFD, waitMs = 10;
+    long dataLen;
+    while (1)
+    {
+        socketFD = connectServer(portNumber);
+        snprintf(buffer, sizeof(buffer), "enc_server fetch %s", jobID);
+        sendData(socketFD, buffer);
+        readData(socketFD, buffer, sizeof(buffer));
+        if (strcmp(buffer, "denied") == 0)
+        {
+            fprintf(stderr, "Error: server on port %d does not take enc_server jobs\n", portNumber);
+            exit(2);
+        }
+        checkThrottled(buffer, portNumber);
+        if (sscanf(buffer, "Job Done %ld", &dataLen) == 1)
+        {
+            break;
+        }
+        close(socketFD);
+        if (strcmp(buffer, "Job Pending") != 0)
+        {
+            fprintf(stderr, "Error: no job %s on enc_server port %d\n", jobID, portNumber);
+            exit(1);
+        }
+        usleep(waitMs * 1000);
+        waitMs = waitMs < 1000 ? waitMs * 2 : 1000;
+    }
+    sendData(socketFD, "Waiting for ciphertext..");
+
+    // result goes straight to the output file, or is streamed to stdout a window at a time
+    if (outputName != NULL)
+    {
+        off_t outputLen = dataLen + (binaryMode ? 0 : 1);                   // text output ends in a newline
+        outputFD = open(outputName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (outputFD < 0)
+        {
+            fprintf(stderr,"Error: could not open output file \'%s\'\n", outputName);
+            exit(1);
+        }
+        if (fallocate(outputFD, 0, 0, outputLen) < 0 && ftruncate(outputFD, outputLen) < 0)
+        {
+            error("CLIENT: ERROR sizing output file");
+        }
+        receiveToFile(socketFD, outputFD, 0, dataLen);
+        if (!binaryMode && pwrite(outputFD, "\n", 1, dataLen) != 1)
+        {
+            error("CLIENT: ERROR writing output file");
+        }
+        close(outputFD);
+    }
+    else
+    {
+        char window[65536];
+        long totalRead = 0;
+        while (totalRead < dataLen)
+        {
+            ssize_t charsRead = recv(socketFD, window, sizeof(window), 0);
+            if (charsRead <= 0)
+            {
+                fprintf(stderr, "Error: server closed connection\n");
+                exit(2);
+            }
+            fwrite(window, 1, charsRead, stdout);
+            totalRead += charsRead;
+        }
+        if (!binaryMode)
+        {
+            putchar('\n');
+        }
+    }
+    close(socketFD);
+}
+
+// Connects to the server's shared memory transport on the unix socket at path and maps the channel it hands over
+// as a memfd.  The socket stays open so each side can tell when the other has gone
+struct shmChannel *connectShm(char *path, int *socketFD)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    *socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (*socketFD < 0 || connect(*socketFD, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "Error: could not contact enc_server shared memory transport at %s\n", path);
+        exit(2);
+    }
+
+    // the channel's memfd arrives as SCM_RIGHTS ancillary data
+    int channelFD = -1;
+    char byte, control[CMSG_SPACE(sizeof(int))];
+    struct iovec byteVec = {&byte, 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &byteVec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg;
+    if (recvmsg(*socketFD, &msg, 0) > 0 && (cmsg = CMSG_FIRSTHDR(&msg)) != NULL && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(&channelFD, CMSG_DATA(cmsg), sizeof(int));
+    }
+    struct shmChannel *channel = channelFD < 0 ? MAP_FAILED :
+                                 mmap(NULL, sizeof(struct shmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, channelFD, 0);
+    if (channel == MAP_FAILED || memcmp(channel->magic, "OTPRING1", 8) != 0)
+    {
+        fprintf(stderr, "Error: no shared memory channel from enc_server at %s\n", path);
+        exit(2);
+    }
+    close(channelFD);
+    return channel;
+}
+
+// Waits for the ring's tail to move on from seen, spinning for upto spinBudget checks before sleeping on a futex
+// for upto timeoutMs.  The budget doubles when spinning catches the change and halves when it ends in a sleep.
+// Returns 0 if it timed out
+int shmWait(struct shmRing *ring, uint32_t seen, int *spinBudget, int timeoutMs)
+{
+    for (int i = 0; i < *spinBudget; i++)
+    {
+        if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != seen)
+        {
+            *spinBudget = *spinBudget < SHM_MAX_SPIN ? *spinBudget * 2 : SHM_MAX_SPIN;
+            return 1;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();                                             // ease off the sibling hyperthread while spinning
+#endif
+    }
+    *spinBudget = *spinBudget > SHM_MIN_SPIN ? *spinBudget / 2 : SHM_MIN_SPIN;
+
+    // announce the sleep before the last check so a producer publishing in between knows to wake us
+    struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == seen)
+    {
+        syscall(SYS_futex, &ring->tail, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    }
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != seen;
+}
+
+// Publishes the ring's slots upto newTail, waking the consumer only if it went to sleep
+void shmPublish(struct shmRing *ring, uint32_t newTail)
+{
+    __atomic_store_n(&ring->tail, newTail, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+    {
+        syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+// Exits with the matching error if a shared memory request did not go through
+void checkShmReply(struct shmReply *reply, char *path)
+{
+    if (reply->status == SHM_THROTTLED)
+    {
+        fprintf(stderr, "Error: enc_server at %s is throttling requests, retry after %d ms\n", path, reply->len);
+        exit(3);
+    }
+    if (reply->status == SHM_KEY_REUSED)
+    {
+        fprintf(stderr, "Error: enc_server at %s rejected key as already used\n", path);
+        exit(2);
+    }
+    if (reply->status != SHM_DONE)
+    {
+        fprintf(stderr, "Error: enc_server at %s rejected request\n", path);
+        exit(2);
+    }
+}
+
+// Runs count copies of the request over the shared memory transport at path, keeping the submission ring as full as
+// replies allow, and stores the first reply's ciphertext in ciphertext.  Each copy takes the next dataLen chars of
+// the keyLen char key as its pad, so repeats are only sent with a pad already used once the key runs out
+void runShmRequests(char *path, char *plaintext, char *key, int keyLen, int dataLen, char *ciphertext, int count)
+{
+    int socketFD, spinBudget = SHM_MIN_SPIN;
+    int numPads = dataLen > 0 ? keyLen / dataLen : 1;
+    uint32_t submitted = 0, completed = 0;
+    struct timespec start, end;
+    struct shmChannel *channel = connectShm(path, &socketFD);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (completed < count)
+    {
+        // fill every free slot then publish them together
+        uint32_t queued = submitted;
+        while (queued < count && queued - completed < SHM_RING_SLOTS)
+        {
+            struct shmRequest *request = &channel->requests[queued % SHM_RING_SLOTS];
+            request->len = dataLen;
+            request->binary = binaryMode;
+            memcpy(request->plaintext, plaintext, dataLen);
+            memcpy(request->key, key + (queued % numPads) * dataLen, dataLen);
+            queued++;
+        }
+        if (queued != submitted)
+        {
+            submitted = queued;
+            shmPublish(&channel->submit, submitted);
+        }
+
+        // take every reply that is ready, or wait for one
+        uint32_t tail = __atomic_load_n(&channel->complete.tail, __ATOMIC_ACQUIRE);
+        if (tail == completed)
+        {
+            char byte;
+            if (!shmWait(&channel->complete, tail, &spinBudget, 1000) &&
+                recv(socketFD, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)    // server went away
+            {
+                fprintf(stderr, "Error: server closed connection\n");
+                exit(2);
+            }
+            continue;
+        }
+        for (; completed != tail; completed++)
+        {
+            struct shmReply *reply = &channel->replies[completed % SHM_RING_SLOTS];
+            if (reply->status == SHM_KEY_REUSED && completed >= numPads)             // server is catching pad reuse
+            {
+                fprintf(stderr, "Error: enc_server at %s rejected repeat %u as reusing a pad - the key only holds %d "
+                        "pads of %d chars, use a longer key, a smaller -n or a server without -K\n", path,
+                        completed + 1, numPads, dataLen);
+                exit(2);
+            }
+            checkShmReply(reply, path);
+            if (completed == 0)
+            {
+                memcpy(ciphertext, reply->ciphertext, dataLen);
+            }
+        }
+        __atomic_store_n(&channel->complete.head, completed, __ATOMIC_RELEASE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (count > 1)                                                          // report the rate when used as a benchmark
+    {
+        double us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+        fprintf(stderr, "CLIENT: %d requests over shared memory in %.0f us, %.2f us each\n", count, us, us / count);
+    }
+    munmap(channel, sizeof(struct shmChannel));
+    close(socketFD);
+}
+
+// Reads exactly len bytes at offset in fileFD into buffer, returns 0 if the file ends first
+int readFileRange(int fileFD, char *buffer, long offset, long len)
+{
+    long totalRead = 0;
+    while (totalRead < len)
+    {
+        ssize_t charsRead = pread(fileFD, buffer + totalRead, len - totalRead, offset + totalRead);
+        if (charsRead < 0)
+        {
+            error("CLIENT: ERROR reading input file");
+        }
+        if (charsRead == 0)
+        {
+            return 0;
+        }
+        totalRead += charsRead;
+    }
+    return 1;
+}
+
+// Picks how many processes to spread a container's blocks across - like stripes, no more than there are cores or
+// requests the servers take at once
+int chooseBlockWorkers(long numBlocks, int numPorts)
+{
+    long workers = numBlocks;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 0 && workers > cores)
+    {
+        workers = cores;
+    }
+    if (workers > MAX_STRIPES_PER_PORT * numPorts)
+    {
+        workers = MAX_STRIPES_PER_PORT * numPorts;
+    }
+    return workers;
+}
+
+// Encrypts the plaintext file into a block container, with the data's pad starting at padOffset in the key file.
+// Each block is sent as a request of its own by worker processes spread across the ports, which splice the
+// ciphertext straight into the block's place in the container.  The header is written last, so a container that
+// failed part way through is never taken for a whole one
+void writeContainer(int *ports, int numPorts, char *plaintextName, char *keyName, long padOffset, char *containerName)
+{
+    int plaintextFD, keyFD, childStatus, failed = 0;
+    long dataLen = openJobFile(plaintextName, &plaintextFD);
+    long keyLen = openJobFile(keyName, &keyFD);
+    if (dataLen == 0)
+    {
+        fprintf(stderr,"Error: \'%s\' is empty\n", plaintextName);
+        exit(1);
+    }
+    if (padOffset < 0 || keyLen - padOffset < dataLen)
+    {
+        fprintf(stderr,"Error: key \'%s\' is too short\n", keyName);
+        exit(1);
+    }
+
+    // lay out the index, each block's pad following on from the last
+    struct containerHeader header;
+    memcpy(header.magic, "OTPBLKS1", 8);
+    header.binary = binaryMode;
+    header.blockSize = CONTAINER_BLOCK_SIZE;
+    header.dataLength = dataLen;
+    header.numBlocks = (dataLen + CONTAINER_BLOCK_SIZE - 1) / CONTAINER_BLOCK_SIZE;
+    long indexLen = header.numBlocks * sizeof(struct containerBlock);
+    struct containerBlock *index = malloc(indexLen);
+    if (index == NULL)
+    {
+        error("CLIENT: ERROR allocating container index");
+    }
+    for (long i = 0; i < header.numBlocks; i++)
+    {
+        long blockStart = i * CONTAINER_BLOCK_SIZE;
+        index[i].dataOffset = sizeof(header) + indexLen + blockStart;
+        index[i].padOffset = padOffset + blockStart;
+        index[i].length = dataLen - blockStart < CONTAINER_BLOCK_SIZE ? dataLen - blockStart : CONTAINER_BLOCK_SIZE;
+    }
+
+    // replies are spliced into the container through outputFD
+    outputFD = open(containerName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (outputFD < 0)
+    {
+        fprintf(stderr,"Error: could not open container \'%s\'\n", containerName);
+        exit(1);
+    }
+    off_t containerLen = sizeof(header) + indexLen + dataLen;
+    if ((fallocate(outputFD, 0, 0, containerLen) < 0 && ftruncate(outputFD, containerLen) < 0) ||
+        pwrite(outputFD, index, indexLen, sizeof(header)) != indexLen)
+    {
+        error("CLIENT: ERROR writing container");
+    }
+
+    // each worker takes every workers'th block, flagging itself done once all of them are through
+    int workers = chooseBlockWorkers(header.numBlocks, numPorts);
+    char *doneFlags = mmap(NULL, workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (doneFlags == MAP_FAILED)
+    {
+        error("CLIENT: ERROR mapping block flags");
+    }
+    memset(doneFlags, 0, workers);
+    for (int w = 0; w < workers; w++)
+    {
+        switch (fork())
+        {
+        case -1:
+            error("CLIENT: ERROR forking block worker");
+
+        case 0:
+        {
+            char *plaintext = malloc(2 * CONTAINER_BLOCK_SIZE), *key = plaintext + CONTAINER_BLOCK_SIZE;
+            if (plaintext == NULL)
+            {
+                error("CLIENT: ERROR allocating block buffers");
+            }
+            for (long i = w; i < header.numBlocks; i += workers)
+            {
+                if (!readFileRange(plaintextFD, plaintext, i * CONTAINER_BLOCK_SIZE, index[i].length) ||
+                    !readFileRange(keyFD, key, index[i].padOffset, index[i].length))
+                {
+                    fprintf(stderr,"Error: input changed while writing container \'%s\'\n", containerName);
+                    exit(1);
+                }
+                runRequest(ports[i % numPorts], plaintext, key, index[i].length, NULL, index[i].dataOffset);
+            }
+            doneFlags[w] = 1;
+            exit(0);
+        }
+
+        default:
+            break;
+        }
+    }
+
+    // wait on all workers and pass along the first failure
+    while (wait(&childStatus) > 0)
+    {
+        if ((!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) && failed == 0)
+        {
+            failed = WIFEXITED(childStatus) ? WEXITSTATUS(childStatus) : 2;
+        }
+    }
+    for (int w = 0; w < workers && failed == 0; w++)
+    {
+        if (doneFlags[w] == 0)
+        {
+            failed = 2;
+        }
+    }
+    munmap(doneFlags, workers);
+    if (failed != 0)
+    {
+        unlink(containerName);
+        exit(failed);
+    }
+    if (pwrite(outputFD, &header, sizeof(header), 0) != sizeof(header))
+    {
+        error("CLIENT: ERROR writing container");
+    }
+    close(outputFD);
+    close(plaintextFD);
+    close(keyFD);
+    free(index);
+}
+
+// Splits the request into stripes which are each sent over their own connection (round robin across the given
+// ports), read straight from the plaintext and key files so inputs of any size can be striped.  Stripes are kept
+// under the server's message size, and spread across worker processes which each write their ciphertext into the
+// output file or a shared buffer printed once all of them are through
+void runStripedRequest(int *ports, int numPorts, int plaintextFD, int keyFD, long dataLen)
+{
+    int childStatus, failed = 0;
+    long stripes = chooseStripeCount(dataLen, numPorts);
+    if (stripes < (dataLen + MAX_MSG_SIZE - 2) / (MAX_MSG_SIZE - 1))        // the server takes under MAX_MSG_SIZE
+    {
+        stripes = (dataLen + MAX_MSG_SIZE - 2) / (MAX_MSG_SIZE - 1);
+    }
+    long stripeLen = (dataLen + stripes - 1) / stripes;
+
+    // shared mapping for workers to write results into (unless they go to the output file), followed by one
+    // completion flag per worker
+    int workers = chooseBlockWorkers(stripes, numPorts);
+    long sharedLen = outputFD >= 0 ? 0 : dataLen;
+    char *shared = mmap(NULL, sharedLen + workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        error("CLIENT: ERROR mapping stripe buffer");
+    }
+    char *doneFlags = shared + sharedLen;
+    memset(doneFlags, 0, workers);
+
+    // each worker takes every workers'th stripe, reading just its part of the files
+    for (int w = 0; w < workers; w++)
+    {
+        switch (fork())
+        {
+        case -1:
+            error("CLIENT: ERROR forking stripe");
+
+        case 0:
+        {
+            char *plaintext = malloc(2 * stripeLen), *key = plaintext + stripeLen;
+            if (plaintext == NULL)
+            {
+                error("CLIENT: ERROR allocating stripe buffers");
+            }
+            for (long i = w; i < stripes; i += workers)
+            {
+                long offset = i * stripeLen;
+                long len = dataLen - offset < stripeLen ? dataLen - offset : stripeLen;
+                if (!readFileRange(plaintextFD, plaintext, offset, len) || !readFileRange(keyFD, key, offset, len))
+                {
+                    fprintf(stderr,"Error: input changed while it was being encrypted\n");
+                    exit(1);
+                }
+                runRequest(ports[i % numPorts], plaintext, key, len, outputFD < 0 ? shared + offset : NULL, offset);
+            }
+            doneFlags[w] = 1;                                               // mark worker's stripes as received
+            exit(0);
+        }
+
+        default:
+            break;
+        }
+    }
+
+    // wait on all workers and pass along the first failure
+    while (wait(&childStatus) > 0)
+    {
+        if ((!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) && failed == 0)
+        {
+            failed = WIFEXITED(childStatus) ? WEXITSTATUS(childStatus) : 2;
+        }
+    }
+    for (int w = 0; w < workers && failed == 0; w++)
+    {
+        if (doneFlags[w] == 0)
+        {
+            failed = 2;
+        }
+    }
+    if (failed != 0)
+    {
+        exit(failed);
+    }
+
+    // ciphertext is already in order on disk or in the shared buffer
+    if (outputFD >= 0)
+    {
+        if (!binaryMode && pwrite(outputFD, "\n", 1, dataLen) != 1)       // text output ends in a newline
+        {
+            error("CLIENT: ERROR writing output file");
+        }
+        close(outputFD);
+    }
+    else if (fwrite(shared, 1, dataLen, stdout) != dataLen || (!binaryMode && putchar('\n') == EOF))
+    {
+        error("CLIENT: ERROR writing ciphertext");
+    }
+    munmap(shared, sharedLen + workers);
+}
+
+// Creates the output file and reserves its blocks up front so replies can be spliced straight into place
+void openOutputFile(char *outputName, long dataLen)
+{
+    off_t outputLen = dataLen + (binaryMode ? 0 : 1);                       // text output ends in a newline
+    outputFD = open(outputName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (outputFD < 0)
+    {
+        fprintf(stderr,"Error: could not open output file \'%s\'\n", outputName);
+        exit(1);
+    }
+    if (fallocate(outputFD, 0, 0, outputLen) < 0 && ftruncate(outputFD, outputLen) < 0)
+    {
+        error("CLIENT: ERROR sizing output file");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int plaintextLen, keyLen, numPorts, opt;
+    int ports[MAX_PORTS];
+    char plaintext[MAX_MSG_SIZE];
+    char key[MAX_MSG_SIZE];
+    char ciphertext[MAX_MSG_SIZE];
+    char filePath[256];
+    char *progName = argv[0];
+    char *outputName = NULL;
+    char *fetchID = NULL;
+    int submit = 0;
+    char *shmPath = NULL;
+    int shmCount = 1;
+    char *containerName = NULL;
+    long padOffset = 0;
+
+
+    /*-- Check usage & args --*/
+    while ((opt = getopt(argc, argv, "bo:aF:m:n:C:k:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            binaryMode = 1;                                                 // raw bytes XORed with the key
+            break;
+        case 'o':
+            outputName = optarg;                                            // write ciphertext to this file
+            break;
+        case 'a':
+            submit = 1;                                                     // submit an async job and print its ID
+            break;
+        case 'F':
+            fetchID = optarg;                                               // fetch an async job's ciphertext
+            break;
+        case 'm':
+            shmPath = optarg;                                               // use the server's shared memory transport
+            break;
+        case 'n':
+            shmCount = atoi(optarg);                                        // repeat the request over shared memory
+            break;
+        case 'C':
+            containerName = optarg;                                         // write an indexed block container
+            break;
+        case 'k':
+            padOffset = atol(optarg);                                       // container's pad starts this far into the key
+            break;
+        default:
+            fprintf(stderr,"USAGE: \'%s\' [-b] [-o outfile] plaintext key port[,port...]\n"
+                           "       \'%s\' [-b] -a plaintext key port | [-b] [-o outfile] -F jobid port\n"
+                           "       \'%s\' [-b] [-o outfile] -m ringsocket [-n count] plaintext key\n"
+                           "       \'%s\' [-b] -C container [-k padoffset] plaintext key port[,port...]\n", progName, progName, progName, progName);
+            exit(1);
+        }
+    }
+    argv += optind - 1;                                                     // positional args follow the options
+    argc -= optind - 1;
+    if (fetchID != NULL && argc >= 2)                                       // job results are fetched by ID alone
+    {
+        fetchJob(atoi(argv[1]), fetchID, outputName);
+        return 0;
+    }
+    if (argc < (shmPath != NULL ? 3 : 4) || fetchID != NULL || shmCount < 1 || (submit && shmPath != NULL) ||
+        (containerName != NULL && (submit || shmPath != NULL || outputName != NULL))) 
+    { 
+        fprintf(stderr,"USAGE: \'%s\' [-b] [-o outfile] plaintext key port[,port...]\n"
+                       "       \'%s\' [-b] -a plaintext key port | [-b] [-o outfile] -F jobid port\n"
+                       "       \'%s\' [-b] [-o outfile] -m ringsocket [-n count] plaintext key\n"
+                       "       \'%s\' [-b] -C container [-k padoffset] plaintext key port[,port...]\n", progName, progName, progName, progName); 
+        exit(0); 
+    }
+    if (submit)                                                             // job files are streamed, not loaded
+    {
+        submitJob(atoi(argv[3]), argv[1], argv[2]);
+        return 0;
+    }
+    if (containerName != NULL)                                              // containers are streamed a block at a time
+    {
+        numPorts = parsePorts(argv[3], ports, MAX_PORTS);
+        if (numPorts == 0)
+        {
+            fprintf(stderr,"Error: no port given\n");
+            exit(1);
+        }
+        writeContainer(ports, numPorts, argv[1], argv[2], padOffset, containerName);
+        return 0;
+    }
+
+    // payloads large enough to stripe are read a stripe at a time from the files rather than loaded whole
+    struct stat plaintextStat;
+    snprintf(filePath, sizeof(filePath), "./%s", argv[1]);
+    if (shmPath == NULL && stat(filePath, &plaintextStat) == 0 && plaintextStat.st_size >= 2 * STRIPE_MIN_SIZE)
+    {
+        int plaintextFD, keyFD;
+        numPorts = parsePorts(argv[3], ports, MAX_PORTS);
+        if (numPorts == 0)
+        {
+            fprintf(stderr,"Error: no port given\n");
+            exit(1);
+        }
+        long dataLen = openJobFile(argv[1], &plaintextFD);
+        if (openJobFile(argv[2], &keyFD) < dataLen)
+        {
+            fprintf(stderr,"Error: key \'%s\' is too short\n", argv[2]);
+            exit(1);
+        }
+        if (outputName != NULL)
+        {
+            openOutputFile(outputName, dataLen);
+        }
+        runStripedRequest(ports, numPorts, plaintextFD, keyFD, dataLen);
+        return 0;
+    }
+
+    /*-- Check Plaintext and Key inputs --*/
+    // Clears all string storage for input
+    memset(filePath, '\0', sizeof(filePath));   
+    memset(plaintext, '\0', sizeof(plaintext));                           
+    memset(key, '\0', sizeof(key));                           
+
+    if (binaryMode)                                                         // binary files take any bytes
+    {
+        plaintextLen = readBinaryFile(argv[1], plaintext, sizeof(plaintext) - 1);
+        keyLen = readBinaryFile(argv[2], key, sizeof(key) - 1);
+    }
+    else
+    {
+        // Open specified plaintext file text for read only
+        strcpy(filePath, "./");                                             // generate filepath
+        strcat(filePath, argv[1]); 
+        FILE *plaintextFile = fopen(filePath, "r");
+        if (plaintextFile == NULL)                                          // error handling for invalid file
+        {
+            fprintf(stderr,"Invalid File: specified plaintext file \'%s\' not found\n", argv[1]); 
+            exit(1);
+        }
+
+        // Check if Plaintext file has valid chars and store file size
+        fgets(plaintext, sizeof(plaintext) - 1, plaintextFile);             // stores file contents to string
+        fclose(plaintextFile);
+        checkFileForValidChars(plaintext, argv[1]);
+        plaintextLen = strlen(plaintext);                                   // store plaintext len
+
+        // Open specified key file text for read only
+        memset(filePath, '\0', sizeof(filePath));                           // clear filepath variable                
+        strcpy(filePath, "./");                                             // generate filepath
+        strcat(filePath, argv[2]); 
+        FILE *keyFile = fopen(filePath, "r");
+        if (keyFile == NULL)                                                // error handling for invalid file
+        {
+            fprintf(stderr,"Invalid File: specified key file %s not found\n", argv[2]);
+            exit(1);
+        }
+
+        // Check if key file has valid chars and store file size
+        fgets(key, sizeof(key) - 1, keyFile);                               // stores file contents to string
+        fclose(keyFile);
+        checkFileForValidChars(key, argv[2]);
+        keyLen = strlen(key);                                               // store key len
+    }
+
+    // check if plaintext is greater than key size, throw error and exit if true
+    if(keyLen < plaintextLen){ 
+        fprintf(stderr,"Error: key \'%s\' is too short\n", argv[2]);
+        exit(1);
+	}
+
+    /*-- Send Encryption Request(s) --*/
+    if (shmPath != NULL && plaintextLen > SHM_MAX_DATA)
+    {
+        fprintf(stderr,"Error: \'%s\' is too large for the shared memory transport, use a port\n", argv[1]);
+        exit(1);
+    }
+    numPorts = shmPath != NULL ? 1 : parsePorts(argv[3], ports, MAX_PORTS);
+    if (numPorts == 0)
+    {
+        fprintf(stderr,"Error: no port given\n");
+        exit(1);
+    }
+    if (outputName != NULL)
+    {
+        openOutputFile(outputName, plaintextLen);
+    }
+
+    memset(ciphertext, '\0', sizeof(ciphertext));
+    if (shmPath != NULL)                                                    // co-located server, no socket per request
+    {
+        runShmRequests(shmPath, plaintext, key, keyLen, plaintextLen, ciphertext, shmCount);
+        if (outputFD >= 0 && pwrite(outputFD, ciphertext, plaintextLen, 0) != plaintextLen)
+        {
+            error("CLIENT: ERROR writing output file");
+        }
+    }
+    else                                                                    // small payloads go over a single connection
+    {
+        runRequest(ports[0], plaintext, key, plaintextLen, ciphertext, 0);
+    }
+    if (outputFD >= 0)
+    {
+        // reply is already on disk, add its newline
+        if (!binaryMode && pwrite(outputFD, "\n", 1, plaintextLen) != 1)
+        {
+            error("CLIENT: ERROR writing output file");
+        }
+        close(outputFD);
+    }
+    else if (binaryMode)
+    {
+        fwrite(ciphertext, 1, plaintextLen, stdout);                        // binary ciphertext is written as is
+    }
+    else
+    {
+        printf("%s\n", ciphertext);                                         // prints ciphertext with added newline char
+    }
+
 	return 0;
-}
\ No newline at end of file
+}
@@ -10,7 +10,48 @@
 *                Encryption via plaintext and key is done via the One-Time Pads model where each letter from 
 *                each file is added together and mod 27 is applied.
 *
-*                Server can handle max message sizes of 100000 bytes and will send transmissions of 1024 bytes/send.
+*                Server can handle max message sizes of 100000 bytes.  Replies are sent as a single corked buffer
+*                rather than 1024 byte transmissions, and SIGUSR1 also prints packets sent/received per request.
+*
+*                Requests are handled by forking a process per connection by default, or by a single process
+*                driving every connection through io_uring when started with "-e uring".  With "-w" a supervisor
+*                runs one such server per CPU, each pinned to its CPU with its own SO_REUSEPORT listener.
+*
+*                With -P the fork engine instead pre-forks a pool of workers with pre-touched buffers, each serving
+*                requests straight from accept() and replaced after -R requests.  -N names a readiness file (or
+*                "fd:N") which gets the server's pid once it can serve.
+*
+*                Both engines drive the same allocation free request session, a state machine fed whatever bytes
+*                arrive which says what to send next.  "-e bench size" and "-e fuzz iterations" run sessions in
+*                process with no sockets, to time requests and to check malformed input is handled safely.
+*
+*                The fork engine schedules requests by their data length: small requests get a fast lane of their
+*                own and large ones run shortest job first, with per class limits set by -t, -s and -l.  Sending
+*                the server SIGUSR1 prints queue wait times per size class.
+*
+*                Clients can be rate limited per address on requests/s and bytes/s with a limits file (-r) which
+*                is re-read on SIGHUP.  Shared memory clients are limited per uid instead, read off their socket.
+*                Throttled clients are told how long to wait before retrying.
+*
+*                With -K the key of every request is fingerprinted into a Bloom filter kept in an mmapped file, and
+*                requests reusing a key are rejected with "Key Reused" (or only logged with -A).
+*
+*                With -J requests of upto 1GB can be submitted as async jobs ("enc_server job"): the upload is
+*                acknowledged with a job ID, the job is encrypted in the background, spooled to disk once a memory
+*                budget (-M) is used up, and its result is later fetched by ID ("enc_server fetch ID").
+*
+*                With -m co-located clients can send requests of upto 4096 chars over shared memory instead: each
+*                client gets a memfd with a pair of lock free rings, served by a process that spins before sleeping.
+*
+*                The io_uring engine gathers small text requests which are ready at the same time into a batch and
+*                encrypts them in a single vectorized pass, upto -B requests at a time, holding a batch back for
+*                upto -D microseconds for more to arrive.
+*
+*                With -c every request adds a line of metadata (arrival time, operation, length, phase timings and
+*                outcome, never its data) to a capture file, which otp_replay plays back to benchmark a build.
+*
+*                An "enc_server binary" request switches to the binary pad: plaintext and key are arbitrary bytes
+*                and are XORed together a SIMD vector at a time instead of being added mod 27.
 *
 */
 
@@ -22,13 +63,59 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>    // getrandom() for job IDs
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <linux/futex.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>     // TCP_INFO segment counters
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
 
 
 // Declare Global Resources 
 static const int MAX_TRANSMISSION_SIZE = 1024;       // maximum size of data for transmission to server
 static const int MAX_MSG_SIZE = 100000;              // maximum size of data to be sent
 static const int CIPHER_TEXT_MOD = 27;               // mod value for ciphertext encryption
+#define PAD_VECTOR_SIZE 32                           // bytes XORed per step by the binary pad kernel
+#define SYMBOL_VECTOR_SIZE 16                        // chars per step of the batched text pad kernel
+#define MAX_PENDING_REQUESTS 64                      // maximum requests accepted at once by the fork engine
+static const int WORKER_READY_TIMEOUT_MS = 10000;    // time a supervisor worker gets to report it is serving
+static const long MAX_SJF_WAIT_US = 2000000;         // large requests waiting this long go ahead of shorter jobs
+#define MAX_RATE_RULES 256                           // maximum number of per address rate limits
+#define MAX_RATE_CLIENTS 1024                        // maximum number of client addresses tracked for rate limits
+#define RATE_UID_CLIENT (1ULL << 32)                 // marks a rate limit client as a uid rather than an address
+#define KEY_INDEX_BLOCKS 262144                      // 64 byte Bloom filter blocks in the key reuse index (16MB)
+#define MAX_KEY_FINGERPRINTS 64                      // maximum key windows fingerprinted per request
+static const int KEY_WINDOW_SIZE = 32;               // chars of key covered by each fingerprint
+static const uint64_t KEY_SAMPLE_MASK = 1023;        // about 1 in 1024 key windows is fingerprinted
+static const int KEY_INDEX_PROBES = 7;               // filter bits set per fingerprint
+#define JOB_ID_LEN 16                                // hex chars in an async job ID
+static const int MAX_JOB_SIZE = 1 << 30;             // maximum size of data for an async job
+#define SHM_RING_SLOTS 64                            // requests in flight per shared memory client, a power of 2
+#define SHM_MAX_DATA 4096                            // largest request taken over the shared memory transport
+static const int SHM_MIN_SPIN = 64;                  // bounds on ring checks made before sleeping on a futex
+static const int SHM_MAX_SPIN = 65536;
+#define URING_ENTRIES 256                            // submission queue size for the io_uring engine
+#define URING_MAX_CONNS 128                          // maximum concurrent connections for the io_uring engine
+#define URING_RECV_BUFS 64                           // number of provided receive buffers, must be a power of 2
+static const int URING_RECV_BUF_SIZE = 16384;        // size of each provided receive buffer
+static const int URING_BUF_GROUP = 1;                // provided buffer group id used for receives
+#define MAX_BATCH_REQUESTS 128                       // most small requests ciphered together in one batch
 
 // Error function used for reporting issues
 void error(const char *msg) {
@@ -45,39 +132,46 @@ void setupAddressStruct(struct sockaddr_in* address, int portNumber)
     address->sin_addr.s_addr = INADDR_ANY;                          // Allow a client at any address to connect to this server
 }
 
-// Send data via provided socket
-int sendData(int socketFD, char *msg)
+// Creates a socket bound and listening on portNumber, shared with other listeners on the port if reusePort is set
+int createListenSocket(int portNumber, int reusePort)
 {
-    int charsWritten = send(socketFD, msg, strlen(msg), 0);                 // Sends msg data to a socket File Descriptor
-    if (charsWritten < 0)                                                   // Error check sent data
-    {                                          
-        error("SERVER: ERROR reading from socket");
-    }
-    if (charsWritten < strlen(msg))
-    {
-        fprintf(stderr,"SERVER: WARNING: Not all data written to socket!\n"); 
-    }
-    return charsWritten;
+    struct sockaddr_in serverAddress;
+    int enable = 1;
+
+    // Create the socket
+    int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket < 0) 
+        error("ERROR opening socket");
+    if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+        error("ERROR setting SO_REUSEPORT");
+
+    // Set up the address struct for the server socket
+    setupAddressStruct(&serverAddress, portNumber);
+
+    // Bind/Associate the socket to the port
+    if (bind(listenSocket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
+        error("ERROR on binding");
+
+    // Start listening for connetions. Allow up to 5 connections to queue up
+    listen(listenSocket, 5); 
+    return listenSocket;
 }
 
-// Read data via provided socket
-int readData(int socketFD, char *buffer, int bufferLen)
+// Send len bytes of data via provided socket, returns -1 if the client has gone away
+int sendData(int socketFD, const char *data, int len)
 {
-    memset(buffer, '\0', bufferLen);                                        // Clear out buffers and charsRead for next recv
-    int charsRead = 0;
-    while (charsRead == 0)                                                  // Wait for next available recv data
+    int totalWritten = 0;
+    while (totalWritten < len)
     {
-        charsRead = recv(socketFD, buffer, bufferLen - 1, 0);               // Read the client's message from the socket
-    }
-    if (charsRead < 0)                                                      // Error check received data
-    {                                          
-        error("SERVER: ERROR writing to socket");
-    }
-    if (charsRead < strlen(buffer))
-    {
-        fprintf(stderr,"SERVER: WARNING: Not all read from socket!\n"); 
+        int charsWritten = send(socketFD, data + totalWritten, len - totalWritten, MSG_NOSIGNAL);
+        if (charsWritten < 0)                                               // Error check sent data
+        {
+            perror("SERVER: ERROR writing to socket");
+            return -1;
+        }
+        totalWritten += charsWritten;
     }
-    return charsRead;
+    return totalWritten;
 }
 
 // Converts integers between 0-26 to chars from A-Z or SPACE
@@ -108,11 +202,11 @@ int ctoi(char c)
     return c;
 }
 
-// Encrypts given plaintext with a given key via the One-Time Pads encryption method
-void encryptData(char *plaintext, char *key, char *ciphertext)
+// Encrypts len chars of given plaintext with a given key via the One-Time Pads encryption method
+void encryptData(const char *plaintext, const char *key, char *ciphertext, int len)
 {
     // iterate through each char in file
-    for (int i = 0; i < strlen(plaintext); i++) {
+    for (int i = 0; i < len; i++) {
         // get plaintext and key chars at index in integer form
         char p = plaintext[i];
         p = ctoi(p);
@@ -128,123 +222,2884 @@ void encryptData(char *plaintext, char *key, char *ciphertext)
     }
 }
 
-int main(int argc, char *argv[])
+// Vector of pad bytes, gcc lowers operations on it to the widest SIMD registers the target has
+typedef unsigned char padVector __attribute__((vector_size(PAD_VECTOR_SIZE)));
+
+// Binary pad mode - XORs each byte of input with the key a vector at a time.  XOR is its own inverse so the same
+// kernel both encrypts and decrypts, and output may be the same buffer as input
+void xorData(const char *input, const char *key, char *output, int len)
 {
-    int connectionSocket, charsRead, charsWritten, dataLength, activeConnections, childStatus, childSocket;
-    char buffer[MAX_TRANSMISSION_SIZE];
-    char plaintext[MAX_MSG_SIZE];
-    char key[MAX_MSG_SIZE];
-    char ciphertext[MAX_MSG_SIZE];
-    struct sockaddr_in serverAddress, clientAddress;
-    socklen_t sizeOfClientInfo = sizeof(clientAddress);
-    pid_t childPid;
+    int i = 0;
+    for (; i + PAD_VECTOR_SIZE <= len; i += PAD_VECTOR_SIZE)
+    {
+        padVector in, k;
+        memcpy(&in, input + i, PAD_VECTOR_SIZE);    // memcpy as buffers have no alignment guarantees
+        memcpy(&k, key + i, PAD_VECTOR_SIZE);
+        in ^= k;
+        memcpy(output + i, &in, PAD_VECTOR_SIZE);
+    }
+    for (; i < len; i++)                            // tail shorter than a vector
+    {
+        output[i] = input[i] ^ key[i];
+    }
+}
 
-    /*-- Check usage & args --*/
-    if (argc < 2) 
-    { 
-        fprintf(stderr,"USAGE: %s port\n", argv[0]); 
-        exit(1);
+// Vector of text pad symbols.  Byte compares only map onto single instructions for 16 byte signed vectors on the
+// baseline x86-64 target, wider vectors of them get split up into scalar code
+typedef signed char symbolVector __attribute__((vector_size(SYMBOL_VECTOR_SIZE)));
+
+// Vector form of encryptData - the same mod 27 add done branch free with masks, so gcc runs it a symbolVector of
+// chars at a time.  Used on batches of small requests gathered end to end, where calls per request mostly run tails
+void encryptVector(const char *plaintext, const char *key, char *ciphertext, int len)
+{
+    int i = 0;
+    for (; i + SYMBOL_VECTOR_SIZE <= len; i += SYMBOL_VECTOR_SIZE)
+    {
+        symbolVector p, k;
+        memcpy(&p, plaintext + i, SYMBOL_VECTOR_SIZE);
+        memcpy(&k, key + i, SYMBOL_VECTOR_SIZE);
+        p -= 'A';                                   // A-Z to 0-25, SPACE goes below 0 and becomes 26
+        k -= 'A';
+        p = (p & ~(p < 0)) | ((p < 0) & 26);
+        k = (k & ~(k < 0)) | ((k < 0) & 26);
+
+        p += k;                                     // 0-52, take off 27 where it went over
+        p -= (p > 26) & 27;
+        symbolVector space = p == 26;
+        p = ((p + 'A') & ~space) | (space & ' ');
+        memcpy(ciphertext + i, &p, SYMBOL_VECTOR_SIZE);
     }
-    
-    /*-- Create and Bind Socket & Start Listening For Connections --*/
-    // Create the socket
-    int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenSocket < 0) 
-        error("ERROR opening socket");
+    encryptData(plaintext + i, key + i, ciphertext + i, len - i);   // tail shorter than a vector
+}
 
-    // Set up the address struct for the server socket
-    setupAddressStruct(&serverAddress, atoi(argv[1]));
+// Async job API request carried by a request type message
+enum jobRequest { JOB_NONE, JOB_SUBMIT, JOB_FETCH };
 
-    // Bind/Associate the socket to the port
-    if (bind(listenSocket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
-        error("ERROR on binding");
+// Checks a request type message is for this server - "enc_server", optionally followed by "binary" for the byte
+// oriented XOR pad and/or "job" to submit an async job, or "enc_server fetch ID" for a job's result - and sets the
+// options it asks for.  Returns 0 for requests meant for another server
+int parseRequestType(const char *msg, int len, int *binary, int *job, char *jobID)
+{
+    char type[64], *word, *savePtr;
+    if (len >= sizeof(type))
+    {
+        return 0;
+    }
+    memcpy(type, msg, len);
+    type[len] = '\0';
+    *binary = 0;
+    *job = JOB_NONE;
+    word = strtok_r(type, " ", &savePtr);
+    if (word == NULL || strcmp(word, "enc_server") != 0)
+    {
+        return 0;
+    }
+    while ((word = strtok_r(NULL, " ", &savePtr)) != NULL)
+    {
+        if (strcmp(word, "binary") == 0)
+            *binary = 1;
+        else if (strcmp(word, "job") == 0)
+            *job = JOB_SUBMIT;
+        else if (strcmp(word, "fetch") == 0 && (word = strtok_r(NULL, " ", &savePtr)) != NULL &&
+                 strlen(word) == JOB_ID_LEN && strspn(word, "0123456789abcdef") == JOB_ID_LEN)
+        {
+            *job = JOB_FETCH;                                               // IDs are checked as they become file names
+            strcpy(jobID, word);
+        }
+        else
+            return 0;
+    }
+    return 1;
+}
 
-    // Start listening for connetions. Allow up to 5 connections to queue up
-    listen(listenSocket, 5); 
+/*-- Readiness Notification --*/
+// "-N target" tells whoever started the server when it can take requests, so scripts need not sleep and guess.
+// The server's pid is written to target once it is serving, either a readiness file which is removed again when
+// the server exits, or "fd:N" for a descriptor (ie a pipe) inherited from the parent.
 
+static char *readyPath = NULL;                       // readiness file to remove on exit
+static pid_t readyOwner = 0;                         // process which wrote it, forked children leave it alone
 
-    /*-- Queue and Accept Upto 5 Active Connections --*/
-    // Set up perpetual loop for server service
-    activeConnections = 0;
-    while(1){
-        // check num of active encryption requests, if already at 5, does not accept any new connections
-        if (activeConnections <= 5)
+void removeReadyFile()
+{
+    if (readyPath != NULL && getpid() == readyOwner)
+        unlink(readyPath);
+}
+
+// Clears a readiness file left behind by an earlier server, so nobody mistakes it for this one
+void resetReady(char *target)
+{
+    if (target != NULL && strncmp(target, "fd:", 3) != 0)
+        unlink(target);
+}
+
+// Writes the server's pid to the readiness target. Files are written under a temporary name and renamed into place
+// so they never appear half written
+void notifyReady(char *target)
+{
+    char line[32], tempPath[PATH_MAX];
+    if (target == NULL)
+        return;
+    int len = snprintf(line, sizeof(line), "%d\n", (int) getpid());
+    if (strncmp(target, "fd:", 3) == 0)
+    {
+        int readyFD = atoi(target + 3);
+        if (write(readyFD, line, len) != len)
+            perror("SERVER: WARNING: could not write readiness");
+        close(readyFD);
+        return;
+    }
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", target);
+    int readyFD = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (readyFD < 0 || write(readyFD, line, len) != len || rename(tempPath, target) < 0)
+    {
+        perror("SERVER: WARNING: could not write readiness file");
+    }
+    else if (readyPath == NULL)
+    {
+        readyPath = target;
+        readyOwner = getpid();
+        atexit(removeReadyFile);
+    }
+    if (readyFD >= 0)
+        close(readyFD);
+}
+
+/*-- Supervisor Mode --*/
+// With "-w" the server runs as a supervisor which starts a worker per CPU.  Each worker has its own SO_REUSEPORT
+// listener so the kernel spreads new connections across them, and is pinned to its CPU.  Listeners are owned by
+// the supervisor and handed down to workers, so workers can be restarted (or upgraded with SIGHUP) without ever
+// closing a listener and dropping queued connections.  Workers report readiness to the supervisor over a pipe, and
+// an upgrade replaces one worker at a time, only stopping the old worker once its replacement is serving.
+
+struct workerSlot
+{
+    pid_t pid;                                       // worker currently serving this slot
+    int listenSocket;                                // SO_REUSEPORT listener owned by the supervisor
+    int cpu;                                         // CPU the worker is pinned to
+};
+
+static volatile sig_atomic_t stopRequested = 0;      // set by SIGTERM/SIGINT - stop accepting and finish requests
+static volatile sig_atomic_t reloadRequested = 0;    // set by SIGHUP - supervisor restarts workers one at a time
+static volatile sig_atomic_t statsRequested = 0;     // set by SIGUSR1 - print scheduler stats
+
+void handleStopSignal(int signo)
+{
+    stopRequested = 1;
+}
+
+void handleReloadSignal(int signo)
+{
+    reloadRequested = 1;
+}
+
+void handleStatsSignal(int signo)
+{
+    statsRequested = 1;
+}
+
+// Installs a signal handler without SA_RESTART so blocking accept / wait calls return and see the request
+void installSignalHandler(int signo, void (*handler)(int))
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(signo, &action, NULL);
+}
+
+// Returns the NUMA node of a CPU, or 0 if it cannot be found
+int getCpuNode(int cpu)
+{
+    char path[64];
+    for (int node = 0; node < 64; node++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0)
+            return node;
+    }
+    return 0;
+}
+
+// Fills cpus with the CPUs this process may run on, ordered round robin across NUMA nodes so that running fewer
+// workers than CPUs still spreads them across nodes. Returns number of CPUs found
+int getWorkerCpus(int *cpus, int maxCpus)
+{
+    cpu_set_t allowed;
+    int nodes[CPU_SETSIZE], ranks[CPU_SETSIZE];
+    int numCpus = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        error("ERROR getting CPU affinity");
+    for (int cpu = 0; cpu < CPU_SETSIZE && numCpus < maxCpus; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        nodes[numCpus] = getCpuNode(cpu);
+        ranks[numCpus] = 0;                          // rank = number of CPUs before this one on the same node
+        for (int i = 0; i < numCpus; i++)
         {
-            // Accept the connection request which creates a connection socket
-            connectionSocket = accept(listenSocket, (struct sockaddr *)&clientAddress, &sizeOfClientInfo); 
-            if (connectionSocket < 0)
-                error("ERROR on accept");
+            if (nodes[i] == nodes[numCpus])
+                ranks[numCpus]++;
+        }
+        cpus[numCpus++] = cpu;
+    }
 
-            childPid = fork();                    // Fork a new child process to handle encryption request
-            switch(childPid)                      // switch statements for error / child / and parent process instructions
-            {                     
-            // for errors
-            case -1:
-                perror("fork()\n");
-                
-            // for child processes - handles encryption requests and sends back ciphertext
-            case 0:
-                /*-- Receive and Confirm Valid Request Type from Client --*/
-                // Receive request type from client
-                charsRead = readData(connectionSocket, buffer, sizeof(buffer));
-                
-                // confirm if request type is valid for this server
-                if (strcmp(buffer, "enc_server") == 0)
-                {
-                    charsWritten = sendData(connectionSocket, "confirmed");
-                }
-                else
-                {
-                    charsWritten = sendData(connectionSocket, "denied");
-                }
+    // sort by rank and then node, so the first CPU of every node comes first, then the second of each, etc
+    for (int i = 1; i < numCpus; i++)
+    {
+        for (int j = i; j > 0 && (ranks[j] < ranks[j - 1] || (ranks[j] == ranks[j - 1] && nodes[j] < nodes[j - 1])); j--)
+        {
+            int temp = cpus[j]; cpus[j] = cpus[j - 1]; cpus[j - 1] = temp;
+            temp = ranks[j]; ranks[j] = ranks[j - 1]; ranks[j - 1] = temp;
+            temp = nodes[j]; nodes[j] = nodes[j - 1]; nodes[j - 1] = temp;
+        }
+    }
+    return numCpus;
+}
 
-                /*-- Receive and Confirm Data Length from Client --*/
-                // Receive data length from client
-                charsRead = readData(connectionSocket, buffer, sizeof(buffer));
-                dataLength = atoi(buffer);                                      // convert string to int for dataLen storage
-                charsWritten = sendData(connectionSocket, "continue");          // confirm that data length reeceived
-
-                /*-- Receive Plaintext Data from Client --*/
-                memset(plaintext, '\0', sizeof(plaintext));
-                charsRead = 0;
-                // continues to read plaintext data from client until expected length
-                while (charsRead < dataLength)
-                {
-                    charsRead += readData(connectionSocket, buffer, sizeof(buffer));
-                    strcat(plaintext, buffer);
-                }
-                sendData(connectionSocket, "Plaintext Received");               // confirm that plaintext reeceived
+// Pins the calling process to a single CPU
+void pinToCpu(int cpu)
+{
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) < 0)
+        perror("SERVER: WARNING: could not pin worker to CPU");
+}
 
-                /*-- Receive Key Data from Client --*/
-                memset(key, '\0', sizeof(key));
-                charsRead = 0;
-                // continues to read key data from client until expected length
-                while (charsRead < dataLength)                                  
-                {
-                    charsRead += readData(connectionSocket, buffer, sizeof(buffer));
-                    strcat(key, buffer);
-                }
-                sendData(connectionSocket, "Key Received");                     // confirm that key received
-                readData(connectionSocket, buffer, sizeof(buffer));             // allows client-side to confirm ready for ciphertext
-
-                /*-- Encrypt Data and Send Back to Client --*/
-                // encrypt data
-                encryptData(plaintext, key, ciphertext);
-
-                // send data back to client
-                charsWritten = 0;
-                int totalWritten = 0;
-                char *tempPtr = ciphertext;                                     // ptr used to track str position as we send data
-                // continues to write ciphertext data to client until end of str reached
-                while (totalWritten < dataLength)
+// Starts a worker for the slot by re-running the server binary with the slot's listener and CPU handed down.  If
+// readyFD is given it is set to a pipe the worker writes its pid to once serving, or -1 if it could not be started
+pid_t spawnWorker(struct workerSlot *slot, struct workerSlot *slots, int numSlots, char *binaryPath, char *argv[],
+                  int *readyFD)
+{
+    int readyPipe[2] = {-1, -1};
+    if (readyFD != NULL && pipe(readyPipe) < 0)
+        perror("SERVER: WARNING: could not create readiness pipe");
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        char value[16];
+        for (int i = 0; i < numSlots; i++)           // workers only keep their own listener
+        {
+            if (slots[i].listenSocket != slot->listenSocket)
+                close(slots[i].listenSocket);
+        }
+        if (readyPipe[1] >= 0)                       // worker reports readiness as if started with -N fd:N
+        {
+            close(readyPipe[0]);
+            snprintf(value, sizeof(value), "fd:%d", readyPipe[1]);
+            setenv("OTP_READY_FD", value, 1);
+        }
+        snprintf(value, sizeof(value), "%d", slot->listenSocket);
+        setenv("OTP_LISTEN_FD", value, 1);
+        snprintf(value, sizeof(value), "%d", slot->cpu);
+        setenv("OTP_WORKER_CPU", value, 1);
+        execv(binaryPath, argv);
+        error("ERROR starting worker");
+    }
+    if (pid < 0)
+        perror("fork()\n");
+    if (readyFD != NULL)
+    {
+        if (readyPipe[1] >= 0)
+            close(readyPipe[1]);
+        if (pid < 0 && readyPipe[0] >= 0)
+            close(readyPipe[0]);
+        *readyFD = pid < 0 ? -1 : readyPipe[0];
+    }
+    return pid;
+}
+
+// Waits for a worker started with a readiness pipe to report it is serving, then closes the pipe.  Returns 0 if the
+// worker exits, or has not reported within WORKER_READY_TIMEOUT_MS
+int waitWorkerReady(int readyFD)
+{
+    char line[32];
+    struct pollfd pipeFD = {readyFD, POLLIN, 0};
+    int ready = 0, polled;
+    if (readyFD < 0)
+        return 0;
+    do                                               // signals are handled by the supervisor loop afterwards
+        polled = poll(&pipeFD, 1, WORKER_READY_TIMEOUT_MS);
+    while (polled < 0 && errno == EINTR);
+    if (polled > 0)
+        ready = read(readyFD, line, sizeof(line)) > 0;  // EOF means the worker exited without reporting
+    close(readyFD);
+    return ready;
+}
+
+// Runs the supervisor for numWorkers workers (0 for one per CPU), never returns
+void runSupervisor(int portNumber, int numWorkers, char *readyTarget, char *argv[])
+{
+    int cpus[CPU_SETSIZE];
+    int childStatus, readyFD;
+    char binaryPath[PATH_MAX];
+    pid_t pid;
+
+    // workers are started from the binary on disk, so a SIGHUP after replacing it upgrades them
+    if (realpath("/proc/self/exe", binaryPath) == NULL)
+        error("ERROR finding server binary");
+
+    int numCpus = getWorkerCpus(cpus, CPU_SETSIZE);
+    if (numWorkers <= 0)
+        numWorkers = numCpus;
+    struct workerSlot *slots = malloc(numWorkers * sizeof(struct workerSlot));
+    int *readyFDs = malloc(numWorkers * sizeof(int));
+    if (slots == NULL || readyFDs == NULL)
+        error("ERROR allocating workers");
+
+    installSignalHandler(SIGTERM, handleStopSignal);
+    installSignalHandler(SIGINT, handleStopSignal);
+    installSignalHandler(SIGHUP, handleReloadSignal);
+
+    for (int i = 0; i < numWorkers; i++)
+    {
+        slots[i].listenSocket = createListenSocket(portNumber, 1);
+        slots[i].cpu = cpus[i % numCpus];
+        slots[i].pid = -1;
+    }
+    // start every worker at once, and only report the server ready once they are all serving
+    for (int i = 0; i < numWorkers; i++)
+    {
+        slots[i].pid = spawnWorker(&slots[i], slots, numWorkers, binaryPath, argv, &readyFDs[i]);
+    }
+    for (int i = 0; i < numWorkers; i++)
+    {
+        if (!waitWorkerReady(readyFDs[i]))
+            fprintf(stderr, "SERVER: WARNING: worker on CPU %d did not report ready\n", slots[i].cpu);
+    }
+    free(readyFDs);
+    notifyReady(readyTarget);
+
+    while (!stopRequested)
+    {
+        pid = wait(&childStatus);
+
+        // restart any worker that died on its own, retired workers no longer own a slot and are ignored
+        for (int i = 0; i < numWorkers && pid > 0; i++)
+        {
+            if (slots[i].pid == pid && !stopRequested)
+            {
+                fprintf(stderr, "SERVER: worker on CPU %d exited, restarting\n", slots[i].cpu);
+                slots[i].pid = spawnWorker(&slots[i], slots, numWorkers, binaryPath, argv, NULL);
+            }
+        }
+
+        // rolling restart - one worker at a time, each old worker is only asked to finish up and exit once its
+        // replacement is serving.  A replacement which never gets going ends the restart with the old workers left
+        // running, so a broken upgrade cannot take the pool down
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            for (int i = 0; i < numWorkers && !stopRequested; i++)
+            {
+                pid_t oldPid = slots[i].pid;
+                pid_t newPid = spawnWorker(&slots[i], slots, numWorkers, binaryPath, argv, &readyFD);
+                if (newPid < 0 || !waitWorkerReady(readyFD))
                 {
-                    charsWritten = send(connectionSocket, tempPtr, MAX_TRANSMISSION_SIZE - 1, 0);
-                    tempPtr += charsWritten;
-                    totalWritten += charsWritten;
+                    fprintf(stderr, "SERVER: replacement worker on CPU %d did not start, keeping old workers\n",
+                            slots[i].cpu);
+                    if (newPid > 0)
+                        kill(newPid, SIGTERM);
+                    break;
                 }
-                
-                /*-- Close connection socket for this client and exit child process --*/
-                close(connectionSocket); 
+                slots[i].pid = newPid;
+                if (oldPid > 0)
+                    kill(oldPid, SIGTERM);
+            }
+        }
+    }
+
+    // pass shutdown along to the workers
+    for (int i = 0; i < numWorkers; i++)
+    {
+        if (slots[i].pid > 0)
+            kill(slots[i].pid, SIGTERM);
+    }
+    while (wait(&childStatus) > 0);
+    exit(0);
+}
+
+/*-- Size Aware Scheduling --*/
+// The fork engine admits many connections but only lets a limited number of requests per size class move past
+// the data length step at once.  Small requests have their own fast lane so they never queue behind huge ones,
+// and waiting large requests go shortest job first (with aging so a huge request is never starved forever).
+// State lives in shared memory so every request process sees it.
+
+enum sizeClass { SMALL_CLASS, LARGE_CLASS, NUM_CLASSES };
+
+struct classStats
+{
+    int limit;                                       // maximum requests of this class running at once
+    int running;                                     // requests of this class currently running
+    long admitted;                                   // total requests admitted
+    long totalWaitUs;                                // total queue wait of admitted requests
+    long maxWaitUs;                                  // longest queue wait of any admitted request
+};
+
+struct schedWaiter
+{
+    pid_t pid;                                       // waiting request process, 0 if entry is free
+    int dataLength;
+    long enqueuedUs;                                 // when request started waiting
+};
+
+struct schedSlot
+{
+    pid_t pid;                                       // request process holding the slot, 0 if free
+    enum sizeClass sizeClass;
+};
+
+struct scheduler
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;                          // broadcast whenever a slot frees up
+    int smallThreshold;                              // requests upto this many chars are small
+    struct classStats classes[NUM_CLASSES];
+    struct schedWaiter waiters[MAX_PENDING_REQUESTS];
+    struct schedSlot slots[MAX_PENDING_REQUESTS];
+};
+
+// Current monotonic time in microseconds
+long nowUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+// Locks the scheduler, recovering the lock if a request process died while holding it
+void lockScheduler(struct scheduler *sched)
+{
+    if (pthread_mutex_lock(&sched->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&sched->lock);
+}
+
+// Creates the scheduler in memory shared with request processes
+struct scheduler *createScheduler(int smallThreshold, int smallLimit, int largeLimit)
+{
+    pthread_mutexattr_t lockAttr;
+    pthread_condattr_t condAttr;
+    struct scheduler *sched = mmap(NULL, sizeof(struct scheduler), PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sched == MAP_FAILED)
+        error("ERROR creating scheduler");
+    memset(sched, 0, sizeof(*sched));
+
+    pthread_mutexattr_init(&lockAttr);
+    pthread_mutexattr_setpshared(&lockAttr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&lockAttr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sched->lock, &lockAttr);
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&sched->changed, &condAttr);
+
+    sched->smallThreshold = smallThreshold;
+    sched->classes[SMALL_CLASS].limit = smallLimit;
+    sched->classes[LARGE_CLASS].limit = largeLimit;
+    return sched;
+}
+
+// Checks if waiter is next in line for a large slot - aged waiters go first (oldest first), then shortest job
+int isNextLargeWaiter(struct scheduler *sched, struct schedWaiter *waiter, long now)
+{
+    int aged = now - waiter->enqueuedUs >= MAX_SJF_WAIT_US;
+    for (int i = 0; i < MAX_PENDING_REQUESTS; i++)
+    {
+        struct schedWaiter *other = &sched->waiters[i];
+        if (other->pid == 0 || other == waiter)
+            continue;
+        int otherAged = now - other->enqueuedUs >= MAX_SJF_WAIT_US;
+        if (otherAged && (!aged || other->enqueuedUs < waiter->enqueuedUs))
+            return 0;
+        if (!aged && !otherAged && other->dataLength < waiter->dataLength)
+            return 0;
+    }
+    return 1;
+}
+
+// Waits until a request of dataLength chars may run and takes a slot in its size class
+void acquireSlot(struct scheduler *sched, int dataLength)
+{
+    pid_t pid = getpid();
+    long enqueuedUs = nowUs();
+    enum sizeClass sizeClass = dataLength <= sched->smallThreshold ? SMALL_CLASS : LARGE_CLASS;
+    struct classStats *stats = &sched->classes[sizeClass];
+    struct schedWaiter *waiter = NULL;
+    struct timespec retry;
+
+    lockScheduler(sched);
+    if (sizeClass == LARGE_CLASS)                    // only large requests need ordering among themselves
+    {
+        for (int i = 0; i < MAX_PENDING_REQUESTS && waiter == NULL; i++)
+        {
+            if (sched->waiters[i].pid == 0)
+                waiter = &sched->waiters[i];
+        }
+        waiter->pid = pid;
+        waiter->dataLength = dataLength;
+        waiter->enqueuedUs = enqueuedUs;
+    }
+
+    // wake up at least every aging period so a waiter notices when it has aged past the shortest jobs
+    while (stats->running >= stats->limit || (waiter != NULL && !isNextLargeWaiter(sched, waiter, nowUs())))
+    {
+        clock_gettime(CLOCK_REALTIME, &retry);
+        retry.tv_sec += 1;
+        if (pthread_cond_timedwait(&sched->changed, &sched->lock, &retry) == EOWNERDEAD)
+            pthread_mutex_consistent(&sched->lock);
+    }
+
+    // take the slot and record how long the request queued
+    long waitUs = nowUs() - enqueuedUs;
+    stats->running++;
+    stats->admitted++;
+    stats->totalWaitUs += waitUs;
+    if (waitUs > stats->maxWaitUs)
+        stats->maxWaitUs = waitUs;
+    if (waiter != NULL)
+        waiter->pid = 0;
+    for (int i = 0; i < MAX_PENDING_REQUESTS; i++)
+    {
+        if (sched->slots[i].pid == 0)
+        {
+            sched->slots[i].pid = pid;
+            sched->slots[i].sizeClass = sizeClass;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Releases any slot or queue entry held by a request process - called by the request itself when done and by
+// the accepting process when reaping it, so a crashed request never leaks its slot
+void releaseSlot(struct scheduler *sched, pid_t pid)
+{
+    lockScheduler(sched);
+    for (int i = 0; i < MAX_PENDING_REQUESTS; i++)
+    {
+        if (sched->slots[i].pid == pid)
+        {
+            sched->slots[i].pid = 0;
+            sched->classes[sched->slots[i].sizeClass].running--;
+        }
+        if (sched->waiters[i].pid == pid)
+        {
+            sched->waiters[i].pid = 0;
+        }
+    }
+    pthread_cond_broadcast(&sched->changed);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Prints queue wait times and usage of each size class to stderr
+void printSchedulerStats(struct scheduler *sched)
+{
+    static const char *classNames[NUM_CLASSES] = {"small", "large"};
+    lockScheduler(sched);
+    for (int i = 0; i < NUM_CLASSES; i++)
+    {
+        struct classStats *stats = &sched->classes[i];
+        fprintf(stderr, "SERVER: %s requests: running %d/%d, admitted %ld, avg wait %ld us, max wait %ld us\n",
+                classNames[i], stats->running, stats->limit, stats->admitted,
+                stats->admitted > 0 ? stats->totalWaitUs / stats->admitted : 0, stats->maxWaitUs);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/*-- Per Client Rate Limiting --*/
+// Each client address gets token buckets for requests/s and bytes/s, checked when the request type and data
+// length arrive so throttled requests never take a scheduler slot.  Shared memory clients all connect from this
+// host, so they are keyed by the uid of the process on the other end of the unix socket instead (RATE_UID_CLIENT
+// | uid).  Throttled clients are sent "throttled <ms>" with how long to wait before retrying.  Limits are read from
+// the -r file (lines of "address requests/s bytes/s" or "uid:UID requests/s bytes/s", plus an optional "default"
+// line, 0 means unlimited) and re-read on SIGHUP.  A bucket holds one second's worth of
+// requests, or one request for limits below 1/s.  Buckets live in a memfd shared with every request process, and
+// handed down to the workers of a supervisor (OTP_LIMITER_FD) so a client's limit holds across all of them.
+
+struct rateRule
+{
+    uint64_t client;                                 // client address, or RATE_UID_CLIENT | uid, the rule applies to
+    double requestsPerSec;                           // 0 for unlimited
+    double bytesPerSec;                              // 0 for unlimited
+};
+
+struct rateBucket
+{
+    uint64_t client;                                 // client address or uid key, 0 if bucket is free
+    double requestTokens;
+    double byteTokens;                               // may go negative, large requests are paid off over time
+    long lastRefillUs;
+};
+
+struct rateLimiter
+{
+    pthread_mutex_t lock;
+    char rulesPath[PATH_MAX];                        // limits file, empty if rate limiting is off
+    struct rateRule defaultRule;
+    struct rateRule rules[MAX_RATE_RULES];
+    int numRules;
+    struct rateBucket buckets[MAX_RATE_CLIENTS];
+};
+
+// Locks the rate limiter, recovering the lock if a request process died while holding it
+void lockRateLimiter(struct rateLimiter *limiter)
+{
+    if (pthread_mutex_lock(&limiter->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&limiter->lock);
+}
+
+// Returns 1 if two rules set the same limits for the same client
+int sameRateRule(struct rateRule *a, struct rateRule *b)
+{
+    return a->client == b->client && a->requestsPerSec == b->requestsPerSec && a->bytesPerSec == b->bytesPerSec;
+}
+
+// Reads the limits file, keeping the current limits if it cannot be read.  Buckets are only refilled when the
+// limits have changed, so workers reading the same file as they start do not hand clients fresh bursts
+void loadRateLimits(struct rateLimiter *limiter)
+{
+    char line[256], address[64];
+    double requestsPerSec, bytesPerSec;
+    struct rateRule defaultRule = {0, 0, 0};
+    struct rateRule rules[MAX_RATE_RULES];
+    struct in_addr parsed;
+    char *uidEnd;
+    int numRules = 0;
+    if (limiter->rulesPath[0] == '\0')              // rate limiting is off
+        return;
+    FILE *rulesFile = fopen(limiter->rulesPath, "r");
+    if (rulesFile == NULL)
+    {
+        fprintf(stderr, "SERVER: WARNING: could not read rate limits from %s\n", limiter->rulesPath);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), rulesFile) != NULL)
+    {
+        if (line[0] == '#' || sscanf(line, "%63s %lf %lf", address, &requestsPerSec, &bytesPerSec) != 3)
+            continue;                                // skip comments and blank lines
+        struct rateRule rule = {0, requestsPerSec, bytesPerSec};
+        if (strcmp(address, "default") == 0)
+            defaultRule = rule;
+        else if (strncmp(address, "uid:", 4) == 0)
+        {
+            unsigned long uid = strtoul(address + 4, &uidEnd, 10);
+            if (uidEnd == address + 4 || *uidEnd != '\0' || uid > UINT32_MAX)
+                fprintf(stderr, "SERVER: WARNING: skipping rate limit for invalid uid '%s'\n", address);
+            else if (numRules < MAX_RATE_RULES)
+            {
+                rule.client = RATE_UID_CLIENT | uid;
+                rules[numRules++] = rule;
+            }
+        }
+        else if (inet_aton(address, &parsed) == 0)
+            fprintf(stderr, "SERVER: WARNING: skipping rate limit for invalid address '%s'\n", address);
+        else if (numRules < MAX_RATE_RULES)
+        {
+            rule.client = parsed.s_addr;
+            rules[numRules++] = rule;
+        }
+    }
+    fclose(rulesFile);
+
+    lockRateLimiter(limiter);
+    int changed = numRules != limiter->numRules || !sameRateRule(&defaultRule, &limiter->defaultRule);
+    for (int i = 0; i < numRules && !changed; i++)
+        changed = !sameRateRule(&rules[i], &limiter->rules[i]);
+    if (changed)
+    {
+        limiter->defaultRule = defaultRule;
+        memcpy(limiter->rules, rules, numRules * sizeof(struct rateRule));
+        limiter->numRules = numRules;
+        memset(limiter->buckets, 0, sizeof(limiter->buckets));  // start everyone over with full buckets
+    }
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+// Creates the rate limiter in memory shared with request processes, rulesPath may be NULL for no limits.  Workers
+// started by a supervisor attach to the supervisor's limiter instead, and re-read the limits file
+struct rateLimiter *createRateLimiter(char *rulesPath)
+{
+    pthread_mutexattr_t lockAttr;
+    struct stat limiterStat;
+    struct rateLimiter *limiter;
+    char value[16];
+    char *inheritedLimiter = getenv("OTP_LIMITER_FD");
+    if (inheritedLimiter != NULL)
+    {
+        int inheritedFD = atoi(inheritedLimiter);
+        if (fstat(inheritedFD, &limiterStat) == 0 && limiterStat.st_size == sizeof(struct rateLimiter))
+        {
+            limiter = mmap(NULL, sizeof(struct rateLimiter), PROT_READ | PROT_WRITE, MAP_SHARED, inheritedFD, 0);
+            if (limiter == MAP_FAILED)
+                error("ERROR mapping rate limiter");
+            loadRateLimits(limiter);
+            return limiter;
+        }
+        fprintf(stderr, "SERVER: WARNING: supervisor's rate limiter does not match this build, not sharing it\n");
+    }
+
+    // the memfd is left open across exec, so workers a supervisor starts can map it
+    int limiterFD = memfd_create("otp_rate_limiter", 0);
+    if (limiterFD < 0 || ftruncate(limiterFD, sizeof(struct rateLimiter)) < 0)
+        error("ERROR creating rate limiter");
+    limiter = mmap(NULL, sizeof(struct rateLimiter), PROT_READ | PROT_WRITE, MAP_SHARED, limiterFD, 0);
+    if (limiter == MAP_FAILED)
+        error("ERROR creating rate limiter");
+    snprintf(value, sizeof(value), "%d", limiterFD);
+    setenv("OTP_LIMITER_FD", value, 1);
+    memset(limiter, 0, sizeof(*limiter));
+    pthread_mutexattr_init(&lockAttr);
+    pthread_mutexattr_setpshared(&lockAttr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&lockAttr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&limiter->lock, &lockAttr);
+
+    if (rulesPath != NULL)
+    {
+        strncpy(limiter->rulesPath, rulesPath, sizeof(limiter->rulesPath) - 1);
+        loadRateLimits(limiter);
+    }
+    return limiter;
+}
+
+// Takes requests and bytes from the client's buckets, client being its address or RATE_UID_CLIENT | uid.  Returns 0
+// if allowed, or ms to wait before retrying
+int checkRateLimit(struct rateLimiter *limiter, uint64_t client, int requests, int bytes)
+{
+    if (limiter->rulesPath[0] == '\0')
+        return 0;
+
+    lockRateLimiter(limiter);
+    struct rateRule *rule = &limiter->defaultRule;
+    for (int i = 0; i < limiter->numRules; i++)
+    {
+        if (limiter->rules[i].client == client)
+            rule = &limiter->rules[i];
+    }
+
+    // find the client's bucket, or take over a free one (or the one idle the longest)
+    long now = nowUs();
+    unsigned start = (client * 2654435761u) % MAX_RATE_CLIENTS;
+    struct rateBucket *bucket = NULL, *freeBucket = NULL, *stalest = NULL;
+    for (int i = 0; i < MAX_RATE_CLIENTS; i++)
+    {
+        struct rateBucket *candidate = &limiter->buckets[(start + i) % MAX_RATE_CLIENTS];
+        if (candidate->client == client)
+        {
+            bucket = candidate;
+            break;
+        }
+        if (candidate->client == 0 && freeBucket == NULL)
+            freeBucket = candidate;
+        else if (candidate->client != 0 && (stalest == NULL || candidate->lastRefillUs < stalest->lastRefillUs))
+            stalest = candidate;
+    }
+    double requestBurst = rule->requestsPerSec > 1 ? rule->requestsPerSec : 1;  // room for at least one request
+    if (bucket == NULL)
+    {
+        bucket = freeBucket != NULL ? freeBucket : stalest;
+        bucket->client = client;
+        bucket->requestTokens = requestBurst;        // buckets hold upto one second's worth
+        bucket->byteTokens = rule->bytesPerSec;
+        bucket->lastRefillUs = now;
+    }
+
+    // refill for time passed, capped at the bucket size
+    double elapsed = (now - bucket->lastRefillUs) / 1000000.0;
+    bucket->lastRefillUs = now;
+    bucket->requestTokens += elapsed * rule->requestsPerSec;
+    if (bucket->requestTokens > requestBurst)
+        bucket->requestTokens = requestBurst;
+    bucket->byteTokens += elapsed * rule->bytesPerSec;
+    if (bucket->byteTokens > rule->bytesPerSec)
+        bucket->byteTokens = rule->bytesPerSec;
+
+    int retryMs = 0;
+    if (rule->requestsPerSec > 0 && bucket->requestTokens < requests)
+    {
+        retryMs = (requests - bucket->requestTokens) / rule->requestsPerSec * 1000 + 1;
+    }
+    else if (rule->bytesPerSec > 0 && bucket->byteTokens < 0)
+    {
+        retryMs = -bucket->byteTokens / rule->bytesPerSec * 1000 + 1;
+    }
+    else
+    {
+        if (rule->requestsPerSec > 0)
+            bucket->requestTokens -= requests;
+        if (rule->bytesPerSec > 0)
+            bucket->byteTokens -= bytes;
+    }
+    pthread_mutex_unlock(&limiter->lock);
+    return retryMs;
+}
+
+/*-- Key Reuse Detection --*/
+// With "-K file" each request's key is fingerprinted into a blocked Bloom filter kept in a MAP_SHARED file, so it
+// persists across restarts and is shared by every request process and supervisor worker.  Fingerprints are taken
+// of the first key window plus windows picked by their content (a rolling hash with its low bits clear), so the
+// same key is recognised whatever length or stripe of it a request uses.  Each fingerprint sets bits within a
+// single cache line with atomic fetch-ors, which also tell whether the bits were already set, so checking and
+// recording a key is one lock free pass.
+
+struct keyIndexHeader
+{
+    char magic[8];                                   // identifies a key index file
+    long numBlocks;                                  // number of 64 byte filter blocks
+    long requests;                                   // metrics: keys checked
+    long reuses;                                     // metrics: keys found to be reused
+};
+
+struct keyIndex
+{
+    struct keyIndexHeader *header;
+    uint64_t *blocks;                                // filter bits, 8 words per block
+    int alertOnly;                                   // 1 to only log reused keys rather than reject them
+};
+
+// Opens (or creates) the key index file at indexPath, returns NULL if key reuse detection is off
+struct keyIndex *openKeyIndex(char *indexPath, int alertOnly)
+{
+    size_t headerSize = 4096;                        // keeps filter blocks page and cache line aligned
+    size_t mapSize = headerSize + (size_t) KEY_INDEX_BLOCKS * 64;
+    if (indexPath == NULL)
+        return NULL;
+
+    int indexFD = open(indexPath, O_RDWR | O_CREAT, 0600);
+    if (indexFD < 0)
+        error("ERROR opening key index");
+    if (ftruncate(indexFD, mapSize) < 0)
+        error("ERROR sizing key index");
+    char *mapping = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, indexFD, 0);
+    if (mapping == MAP_FAILED)
+        error("ERROR mapping key index");
+    close(indexFD);
+
+    struct keyIndex *index = malloc(sizeof(struct keyIndex));
+    if (index == NULL)
+        error("ERROR allocating key index");
+    index->header = (struct keyIndexHeader *) mapping;
+    index->blocks = (uint64_t *) (mapping + headerSize);
+    index->alertOnly = alertOnly;
+    if (memcmp(index->header->magic, "OTPKEYIX", 8) != 0 || index->header->numBlocks != KEY_INDEX_BLOCKS)
+    {
+        memset(mapping, 0, mapSize);                 // new (or differently sized) index starts empty
+        memcpy(index->header->magic, "OTPKEYIX", 8);
+        index->header->numBlocks = KEY_INDEX_BLOCKS;
+    }
+    return index;
+}
+
+// Mixes a hash so all of its bits depend on all of the input (splitmix64 finalizer)
+uint64_t mixHash(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+// Sets a fingerprint's bits in its filter block, returns 1 if they were all already set
+int addFingerprint(struct keyIndex *index, uint64_t fingerprint)
+{
+    uint64_t *block = index->blocks + (fingerprint % KEY_INDEX_BLOCKS) * 8;
+    uint64_t probe = fingerprint >> 32 | 1;
+    int present = 1;
+    for (int i = 0; i < KEY_INDEX_PROBES; i++)
+    {
+        probe = mixHash(probe);
+        int bit = probe & 511;
+        uint64_t mask = 1ULL << (bit & 63);
+        present &= (__atomic_fetch_or(&block[bit >> 6], mask, __ATOMIC_RELAXED) & mask) != 0;
+    }
+    return present;
+}
+
+// Records the key of a request in the index and checks if it was seen before.  Returns 1 if the key was reused
+// and the request should be rejected, logging the reuse instead when alerting only
+int checkKeyReuse(struct keyIndex *index, const char *key, int len, in_addr_t clientAddress)
+{
+    uint64_t fingerprints[MAX_KEY_FINGERPRINTS];
+    uint64_t rolling = 0, power = 1, base = 0x100000001B3ULL;
+    int numFingerprints = 0, hits;
+    if (index == NULL)
+        return 0;
+
+    // rolling polynomial hash of each window, with power = base^window for dropping the char leaving the window
+    for (int i = 0; i < KEY_WINDOW_SIZE; i++)
+        power *= base;
+    for (int i = 0; i < len && numFingerprints < MAX_KEY_FINGERPRINTS; i++)
+    {
+        rolling = rolling * base + (unsigned char) key[i];
+        if (i >= KEY_WINDOW_SIZE)
+            rolling -= power * (unsigned char) key[i - KEY_WINDOW_SIZE];
+        if (i == KEY_WINDOW_SIZE - 1 || (i >= KEY_WINDOW_SIZE && (mixHash(rolling) & KEY_SAMPLE_MASK) == 0))
+            fingerprints[numFingerprints++] = mixHash(rolling);
+    }
+    if (numFingerprints == 0)                        // key shorter than a window is fingerprinted whole
+        fingerprints[numFingerprints++] = mixHash(rolling ^ len);
+
+    int firstHit = addFingerprint(index, fingerprints[0]);
+    hits = firstHit;
+    for (int i = 1; i < numFingerprints; i++)
+        hits += addFingerprint(index, fingerprints[i]);
+    __atomic_fetch_add(&index->header->requests, 1, __ATOMIC_RELAXED);
+
+    // reused if it starts like a key seen before, or shares two sampled windows with them (one stray hit in the
+    // middle of a key may be a false positive)
+    if (!firstHit && hits < 2)
+        return 0;
+    __atomic_fetch_add(&index->header->reuses, 1, __ATOMIC_RELAXED);
+    struct in_addr address = {clientAddress};
+    fprintf(stderr, "SERVER: ALERT: reused key from %s (%d of %d fingerprints seen)\n", inet_ntoa(address), hits,
+            numFingerprints);
+    return !index->alertOnly;
+}
+
+/*-- Packet Accounting --*/
+// Replies are sent as whole buffers (status messages are the only flush points of the lockstep protocol) and
+// accepted sockets use TCP_NODELAY, so data leaves in full segments and each flush goes out at once.  TCP_INFO
+// segment counters of every finished request are added up in shared memory and printed on SIGUSR1.
+
+struct packetStats
+{
+    long requests;                                   // finished requests measured
+    long segsOut;                                    // all segments sent, including pure acks
+    long dataSegsOut;                                // segments sent carrying data
+    long dataSegsIn;                                 // segments received carrying data
+};
+
+// Creates packet stats in memory shared with request processes
+struct packetStats *createPacketStats()
+{
+    struct packetStats *stats = mmap(NULL, sizeof(struct packetStats), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED)
+        error("ERROR mapping packet stats");
+    memset(stats, 0, sizeof(struct packetStats));
+    return stats;
+}
+
+// Turns off Nagle on a connection so explicit flushes are not held back waiting on acks
+void setNoDelay(int socketFD)
+{
+    int enable = 1;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+// Holds partial segments back while corked, uncorking flushes whatever is left
+void setCork(int socketFD, int cork)
+{
+    setsockopt(socketFD, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
+// Adds the segment counts of a finished request's connection to the stats
+void recordPackets(struct packetStats *stats, int socketFD)
+{
+    struct tcp_info info;
+    socklen_t infoLen = sizeof(info);
+    if (getsockopt(socketFD, IPPROTO_TCP, TCP_INFO, &info, &infoLen) < 0)
+        return;
+    __atomic_fetch_add(&stats->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->segsOut, info.tcpi_segs_out, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->dataSegsOut, info.tcpi_data_segs_out, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->dataSegsIn, info.tcpi_data_segs_in, __ATOMIC_RELAXED);
+}
+
+// Prints average packets per request to stderr
+void printPacketStats(struct packetStats *stats)
+{
+    double requests = stats->requests > 0 ? stats->requests : 1;
+    fprintf(stderr, "SERVER: packets per request over %ld requests: %.1f sent (%.1f with data), %.1f received with data\n",
+            stats->requests, stats->segsOut / requests, stats->dataSegsOut / requests, stats->dataSegsIn / requests);
+}
+
+/*-- Request Session --*/
+// The request protocol as a reentrant state machine shared by every engine.  A session is fed each message (or
+// piece of payload) the client sends and answers with what the engine should do next and which bytes to send.  It
+// only works in the buffers and lengths it is given - it never allocates, blocks, exits or touches a socket - so
+// engines own all of the I/O and the same code can be driven in-process by the bench and fuzz engines.
+
+// Request phases of a session
+enum sessionState { SESSION_TYPE, SESSION_LENGTH, SESSION_ADMIT, SESSION_PLAINTEXT, SESSION_KEY, SESSION_READY,
+                    SESSION_DONE };
+
+// What the engine should do after feeding a session
+enum sessionAction
+{
+    ACTION_READ,                                     // receive more input
+    ACTION_SEND,                                     // send the output, then receive more input
+    ACTION_ADMIT,                                    // data length is known - schedule the request then sessionAdmit()
+    ACTION_REPLY,                                    // send the output (the ciphertext), then close
+    ACTION_SEND_CLOSE,                               // send the output, then close
+    ACTION_CLOSE,                                    // close without sending anything
+    ACTION_JOB,                                      // request is for the async job API, engine takes it over
+    ACTION_BATCH                                     // text data is in - engine runs the cipher, then sessionReply()
+};
+
+struct session
+{
+    enum sessionState state;
+    int binary;                                      // 1 for binary pad requests
+    int job;                                         // JOB_SUBMIT / JOB_FETCH for async job requests
+    char jobID[JOB_ID_LEN + 1];                      // job to fetch
+    int dataLength;                                  // length of plaintext and key for this request
+    int received;                                    // chars received for the current payload phase
+    char *plaintext;                                 // MAX_MSG_SIZE buffers owned by the engine
+    char *key;
+    char *ciphertext;
+    in_addr_t clientAddress;                         // client address for rate limits and alerts
+    uint64_t rateClient;                             // rate limit key, the address unless set after sessionInit
+    struct rateLimiter *limiter;
+    struct keyIndex *keyIndex;                       // NULL unless key reuse detection is on
+    int batchCipher;                                 // 1 if the engine batches text ciphers, set after sessionInit
+    char statusMsg[32];                              // throttled message, kept here until it is sent
+    const char *output;                              // bytes to send for ACTION_SEND, ACTION_REPLY, ACTION_SEND_CLOSE
+    int outputLen;
+};
+
+// Starts a new request session working in the given buffers
+void sessionInit(struct session *s, char *plaintext, char *key, char *ciphertext, in_addr_t clientAddress,
+                 struct rateLimiter *limiter, struct keyIndex *keyIndex)
+{
+    s->state = SESSION_TYPE;
+    s->binary = 0;
+    s->job = JOB_NONE;
+    s->dataLength = 0;
+    s->received = 0;
+    s->plaintext = plaintext;
+    s->key = key;
+    s->ciphertext = ciphertext;
+    s->clientAddress = clientAddress;
+    s->rateClient = clientAddress;
+    s->limiter = limiter;
+    s->keyIndex = keyIndex;
+    s->batchCipher = 0;
+    s->output = NULL;
+    s->outputLen = 0;
+}
+
+// Sets a status message as the session's output and passes the action back
+enum sessionAction sessionStatus(struct session *s, const char *msg, enum sessionAction action)
+{
+    s->output = msg;
+    s->outputLen = strlen(msg);
+    return action;
+}
+
+// Ends the session with a throttled message telling the client how long to wait before retrying
+enum sessionAction sessionThrottled(struct session *s, int retryMs)
+{
+    snprintf(s->statusMsg, sizeof(s->statusMsg), "throttled %d", retryMs);
+    s->state = SESSION_DONE;
+    return sessionStatus(s, s->statusMsg, ACTION_SEND_CLOSE);
+}
+
+// Returns where payload the session is waiting on can be received straight into, setting space to how much is
+// still expected.  Returns NULL outside of payload phases, when input should go through a message buffer
+char *sessionPayloadBuffer(struct session *s, int *space)
+{
+    if (s->state != SESSION_PLAINTEXT && s->state != SESSION_KEY)
+        return NULL;
+    *space = s->dataLength - s->received;
+    return (s->state == SESSION_PLAINTEXT ? s->plaintext : s->key) + s->received;
+}
+
+// Encrypts the session's data, unless ciphered says the engine already put the ciphertext in place for ACTION_BATCH,
+// and hands it back as the reply
+enum sessionAction sessionReply(struct session *s, int ciphered)
+{
+    if (!ciphered && s->binary)
+        xorData(s->plaintext, s->key, s->ciphertext, s->dataLength);
+    else if (!ciphered)
+        encryptData(s->plaintext, s->key, s->ciphertext, s->dataLength);
+    s->state = SESSION_DONE;
+    s->output = s->ciphertext;
+    s->outputLen = s->dataLength;
+    return ACTION_REPLY;
+}
+
+// Feeds len bytes of input from the client to the session and returns what to do next
+enum sessionAction sessionInput(struct session *s, const char *data, int len)
+{
+    char msg[32];
+    int copyLen, retryMs;
+
+    switch (s->state)
+    {
+    // confirm if request type is valid for this server, and if it is for the binary pad
+    case SESSION_TYPE:
+        if (!parseRequestType(data, len, &s->binary, &s->job, s->jobID))
+        {
+            s->state = SESSION_DONE;
+            return sessionStatus(s, "denied", ACTION_SEND_CLOSE);
+        }
+        retryMs = checkRateLimit(s->limiter, s->rateClient, 1, 0);
+        if (retryMs > 0)                                                    // over request rate
+            return sessionThrottled(s, retryMs);
+        if (s->job != JOB_NONE)
+        {
+            s->state = SESSION_DONE;
+            return ACTION_JOB;
+        }
+        s->state = SESSION_LENGTH;
+        return sessionStatus(s, "confirmed", ACTION_SEND);
+
+    // receive data length, dropping requests that will not fit
+    case SESSION_LENGTH:
+        copyLen = len < sizeof(msg) - 1 ? len : sizeof(msg) - 1;
+        memcpy(msg, data, copyLen);
+        msg[copyLen] = '\0';
+        s->dataLength = atoi(msg);
+        if (s->dataLength <= 0 || s->dataLength >= MAX_MSG_SIZE)
+        {
+            s->dataLength = 0;
+            s->state = SESSION_DONE;
+            return ACTION_CLOSE;
+        }
+        retryMs = checkRateLimit(s->limiter, s->rateClient, 0, s->dataLength);
+        if (retryMs > 0)                                                    // over byte rate
+            return sessionThrottled(s, retryMs);
+        s->state = SESSION_ADMIT;
+        return ACTION_ADMIT;
+
+    // receive plaintext and then key data until expected length, anything past it is ignored
+    case SESSION_PLAINTEXT:
+    case SESSION_KEY:
+        copyLen = s->dataLength - s->received;
+        if (copyLen > len)
+            copyLen = len;
+        char *dest = (s->state == SESSION_PLAINTEXT ? s->plaintext : s->key) + s->received;
+        if (data != dest)                                                   // already in place if received there
+            memcpy(dest, data, copyLen);
+        s->received += copyLen;
+        if (s->received < s->dataLength)
+            return ACTION_READ;
+        s->received = 0;
+        if (s->state == SESSION_PLAINTEXT)
+        {
+            s->state = SESSION_KEY;
+            return sessionStatus(s, "Plaintext Received", ACTION_SEND);
+        }
+        if (checkKeyReuse(s->keyIndex, s->key, s->dataLength, s->clientAddress))
+        {
+            s->state = SESSION_DONE;
+            return sessionStatus(s, "Key Reused", ACTION_SEND_CLOSE);   // refuse to encrypt with a used pad
+        }
+        s->state = SESSION_READY;
+        return sessionStatus(s, "Key Received", ACTION_SEND);
+
+    // client is ready for ciphertext - encrypt data and hand it back as the reply
+    case SESSION_READY:
+        if (s->batchCipher && !s->binary)                                   // engine gathers text requests into batches
+            return ACTION_BATCH;
+        return sessionReply(s, 0);
+
+    // no input is expected while waiting to be admitted or once done
+    default:
+        s->state = SESSION_DONE;
+        return ACTION_CLOSE;
+    }
+}
+
+// Lets an admitted request go ahead with sending its data
+enum sessionAction sessionAdmit(struct session *s)
+{
+    if (s->state != SESSION_ADMIT)
+        return ACTION_CLOSE;
+    s->state = SESSION_PLAINTEXT;
+    s->received = 0;
+    return sessionStatus(s, "continue", ACTION_SEND);
+}
+
+/*-- Request Batching --*/
+// Many tiny requests each encrypted on their own mostly run the scalar tail of a call.  Instead sessions answering
+// ACTION_BATCH can have their data gathered end to end into one batch, with a table of where each request starts,
+// which is encrypted in a single pass of the vector kernel and then scattered back to each session's ciphertext.
+
+struct cipherBatch
+{
+    int maxCount;                                    // requests per batch, 1 turns batching off
+    int maxData;                                     // largest request taken into a batch
+    long maxDelayUs;                                 // longest a request is held back waiting for the batch to fill
+    int count;
+    int length;                                      // chars gathered so far
+    long startedUs;                                  // when the first request in the batch joined
+    struct session *sessions[MAX_BATCH_REQUESTS];
+    int tags[MAX_BATCH_REQUESTS];                    // engine's own id for each request, ie its connection
+    int offsets[MAX_BATCH_REQUESTS + 1];             // where each request's data starts, then the total length
+    char *plaintext;                                 // room for maxCount requests of maxData chars
+    char *key;
+    char *ciphertext;
+};
+
+// Creates an empty batch of upto maxCount requests of upto maxData chars each
+struct cipherBatch *createCipherBatch(int maxCount, int maxData, long maxDelayUs)
+{
+    struct cipherBatch *b = malloc(sizeof(struct cipherBatch));
+    if (b == NULL)
+        error("ERROR allocating request batch");
+    b->maxCount = maxCount;
+    b->maxData = maxData;
+    b->maxDelayUs = maxDelayUs;
+    b->count = 0;
+    b->length = 0;
+    b->offsets[0] = 0;
+    b->plaintext = malloc((size_t) 3 * maxCount * maxData);
+    if (b->plaintext == NULL)
+        error("ERROR allocating request batch");
+    b->key = b->plaintext + (size_t) maxCount * maxData;
+    b->ciphertext = b->key + (size_t) maxCount * maxData;
+    return b;
+}
+
+// Gathers a session's data into the batch, returns 0 if it is too large to batch or batching is off
+int batchAdd(struct cipherBatch *b, struct session *s, int tag)
+{
+    if (b->maxCount <= 1 || s->dataLength > b->maxData || b->count == b->maxCount)
+        return 0;
+    if (b->count == 0)
+        b->startedUs = nowUs();
+    memcpy(b->plaintext + b->length, s->plaintext, s->dataLength);
+    memcpy(b->key + b->length, s->key, s->dataLength);
+    b->sessions[b->count] = s;
+    b->tags[b->count] = tag;
+    b->length += s->dataLength;
+    b->offsets[++b->count] = b->length;
+    return 1;
+}
+
+// Encrypts everything in the batch in one pass, hands each session its ciphertext as the reply and empties the
+// batch.  Returns how many requests were run - their tags stay put until the next batchAdd for the engine to reply
+int batchRun(struct cipherBatch *b)
+{
+    int count = b->count;
+    encryptVector(b->plaintext, b->key, b->ciphertext, b->length);
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(b->sessions[i]->ciphertext, b->ciphertext + b->offsets[i], b->offsets[i + 1] - b->offsets[i]);
+        sessionReply(b->sessions[i], 1);
+    }
+    b->count = 0;
+    b->length = 0;
+    return count;
+}
+
+/*-- Traffic Capture --*/
+// With "-c file" each request served by the fork or io_uring engine adds a line of metadata to file - when it
+// arrived, its operation, whether it used the binary pad, its length, the time it spent in each phase and how it
+// ended - and never any of its data.  otp_replay plays a capture back against servers with made up data of the
+// same lengths at the same times, to benchmark a build with real traffic.
+//
+// Phases are timed from when the engine picks the connection up: waiting lasts until the request is admitted
+// (after its type and length are exchanged), upload until all of its data is in and reply until the reply is sent.
+// Phases a request never reached are -1.
+
+static int captureFD = -1;                           // capture file, -1 unless capture is on
+
+struct captureRecord
+{
+    long wallUs;                                     // wall clock time the connection was picked up
+    long startUs;                                    // the same on the clock phases are timed with
+    long admittedUs;                                 // when the request was admitted, 0 until it is
+    long dataUs;                                     // when all of its data was in, 0 until it is
+};
+
+// Opens the capture file to append to, starting new files with a header naming the columns
+void openCapture(char *path)
+{
+    struct stat fileStat;
+    if (path == NULL)
+        return;
+    captureFD = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (captureFD < 0 || fstat(captureFD, &fileStat) < 0)
+        error("ERROR opening capture file");
+    if (fileStat.st_size == 0)
+    {
+        const char *header = "# start_us op binary length wait_us upload_us reply_us total_us result\n";
+        if (write(captureFD, header, strlen(header)) < 0)
+            error("ERROR writing capture file");
+    }
+}
+
+// Starts timing a request the engine has just picked up
+void captureStart(struct captureRecord *r)
+{
+    struct timespec wall;
+    if (captureFD < 0)
+        return;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    r->wallUs = wall.tv_sec * 1000000L + wall.tv_nsec / 1000;
+    r->startUs = nowUs();
+    r->admittedUs = 0;
+    r->dataUs = 0;
+}
+
+// Notes when the session moves into the phases being timed, called after each time it is fed
+void captureProgress(struct captureRecord *r, struct session *s)
+{
+    if (captureFD < 0)
+        return;
+    if (r->admittedUs == 0 && s->state == SESSION_PLAINTEXT)
+        r->admittedUs = nowUs();
+    if (r->dataUs == 0 && s->state == SESSION_READY)
+        r->dataUs = nowUs();
+}
+
+// Adds the finished request's line to the capture file.  Lines go out in a single append so those of requests
+// finishing in other processes never interleave
+void captureFinish(struct captureRecord *r, struct session *s)
+{
+    char line[160];
+    if (captureFD < 0)
+        return;
+    long doneUs = nowUs();
+    const char *result = "closed";                   // hung up, dropped or never asked for its reply
+    if (s->job != JOB_NONE)
+        result = "job";
+    else if (s->output == s->ciphertext)
+        result = "reply";
+    else if (s->output == s->statusMsg)
+        result = "throttled";
+    else if (s->output != NULL && strcmp(s->output, "denied") == 0)
+        result = "denied";
+    else if (s->output != NULL && strcmp(s->output, "Key Reused") == 0)
+        result = "reused";
+
+    int len = snprintf(line, sizeof(line), "%ld %s %d %d %ld %ld %ld %ld %s\n", r->wallUs, "enc",
+                       s->binary, s->dataLength, r->admittedUs ? r->admittedUs - r->startUs : -1,
+                       r->admittedUs && r->dataUs ? r->dataUs - r->admittedUs : -1,
+                       r->dataUs ? doneUs - r->dataUs : -1, doneUs - r->startUs, result);
+    if (write(captureFD, line, len) < 0)
+        perror("SERVER: ERROR writing capture file");
+}
+
+/*-- Async Jobs --*/
+// With "-J dir" clients can submit requests of upto MAX_JOB_SIZE chars as jobs.  The connection only lasts for the
+// upload: the client is handed a job ID and the work is done by a detached background process at a lower priority,
+// so batch jobs never hold a request slot.  Job input is kept in anonymous memory while the global budget (-M)
+// allows, and otherwise spooled to an unlinked file in the spool directory which is mapped in its place, so pages
+// of huge jobs can go back to disk.  Results are written to "<id>.part" and renamed to "<id>.out" once complete, and
+// a fetch streams the result back with sendfile() and then deletes it.
+//
+// Jobs are only served by the fork engine, and a supervisor's workers each have their own memory budget.
+
+struct jobSpool
+{
+    char dir[PATH_MAX - 32];                         // spool directory, leaving room for job file names
+    long budget;                                     // bytes of job input allowed in memory at once
+    long inMemory;                                   // bytes of job input currently in memory, shared by all processes
+};
+
+// Sets up the job spool in dir with a memory budget of budgetMB, returns NULL if jobs are not enabled
+struct jobSpool *createJobSpool(char *dir, long budgetMB)
+{
+    if (dir == NULL)
+        return NULL;
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        error("ERROR creating job spool directory");
+    struct jobSpool *spool = mmap(NULL, sizeof(struct jobSpool), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (spool == MAP_FAILED)
+        error("ERROR mapping job spool");
+    snprintf(spool->dir, sizeof(spool->dir), "%s", dir);
+    spool->budget = budgetMB * 1024 * 1024;
+    spool->inMemory = 0;
+    return spool;
+}
+
+// Builds the path of a job's file with the given suffix
+void jobPath(struct jobSpool *spool, const char *jobID, const char *suffix, char *path)
+{
+    snprintf(path, PATH_MAX, "%s/%s%s", spool->dir, jobID, suffix);
+}
+
+// Fills jobID with a new random job ID of JOB_ID_LEN hex chars
+void newJobID(char *jobID)
+{
+    unsigned char bytes[JOB_ID_LEN / 2];
+    if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes))
+        error("ERROR generating job ID");
+    for (int i = 0; i < sizeof(bytes); i++)
+    {
+        sprintf(jobID + 2 * i, "%02x", bytes[i]);
+    }
+}
+
+// Receives a status message into buffer as a string, returns chars read or <= 0 if the client hung up
+int recvMessage(int socketFD, char *buffer, int bufferLen)
+{
+    int charsRead = recv(socketFD, buffer, bufferLen - 1, 0);
+    buffer[charsRead > 0 ? charsRead : 0] = '\0';
+    return charsRead;
+}
+
+// Receives exactly len bytes of job data straight into dest, returns -1 if the client hung up
+int recvJobData(int socketFD, char *dest, long len)
+{
+    long totalRead = 0;
+    while (totalRead < len)
+    {
+        ssize_t charsRead = recv(socketFD, dest + totalRead, len - totalRead, 0);
+        if (charsRead <= 0)
+            return -1;
+        totalRead += charsRead;
+    }
+    return 0;
+}
+
+// Maps size bytes for a job's input, in memory if the budget allows and otherwise backed by an unlinked spool file
+// (which frees its disk space once every mapping is gone).  Sets inMemory to the bytes charged to the budget
+char *mapJobInput(struct jobSpool *spool, const char *jobID, long size, long *inMemory)
+{
+    char path[PATH_MAX];
+    char *input;
+    if (__atomic_add_fetch(&spool->inMemory, size, __ATOMIC_SEQ_CST) <= spool->budget)
+    {
+        *inMemory = size;
+        input = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return input == MAP_FAILED ? NULL : input;
+    }
+    __atomic_sub_fetch(&spool->inMemory, size, __ATOMIC_SEQ_CST);   // over budget, spool to disk instead
+    *inMemory = 0;
+
+    jobPath(spool, jobID, ".in", path);
+    int inputFD = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (inputFD < 0)
+        return NULL;
+    unlink(path);
+    input = ftruncate(inputFD, size) < 0 ? MAP_FAILED :
+            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, inputFD, 0);
+    close(inputFD);
+    return input == MAP_FAILED ? NULL : input;
+}
+
+// Unmaps a job's input and gives back its share of the memory budget
+void releaseJobInput(struct jobSpool *spool, char *input, long size, long inMemory)
+{
+    munmap(input, size);
+    __atomic_sub_fetch(&spool->inMemory, inMemory, __ATOMIC_SEQ_CST);
+}
+
+// Receives a job's plaintext and key, hands back its ID and starts it on a detached background process
+void serveJobSubmit(int socketFD, struct jobSpool *spool, int binary, in_addr_t clientAddress,
+                    struct rateLimiter *limiter, struct keyIndex *keyIndex)
+{
+    char buffer[MAX_TRANSMISSION_SIZE], jobID[JOB_ID_LEN + 1], path[PATH_MAX], donePath[PATH_MAX];
+    long inMemory;
+
+    // receive data length, dropping jobs that will not fit
+    if (sendData(socketFD, "confirmed", strlen("confirmed")) < 0 || recvMessage(socketFD, buffer, sizeof(buffer)) <= 0)
+        return;
+    long dataLength = atol(buffer);
+    if (dataLength <= 0 || dataLength > MAX_JOB_SIZE)
+        return;
+    int retryMs = checkRateLimit(limiter, clientAddress, 0, dataLength);
+    if (retryMs > 0)                                                        // over byte rate
+    {
+        snprintf(buffer, sizeof(buffer), "throttled %d", retryMs);
+        sendData(socketFD, buffer, strlen(buffer));
+        return;
+    }
+    if (sendData(socketFD, "continue", strlen("continue")) < 0)
+        return;
+
+    // receive plaintext and key straight into the job's input
+    newJobID(jobID);
+    char *input = mapJobInput(spool, jobID, 2 * dataLength, &inMemory);
+    if (input == NULL)
+    {
+        perror("SERVER: ERROR spooling job input");
+        return;
+    }
+    char *plaintext = input, *key = input + dataLength;
+    if (recvJobData(socketFD, plaintext, dataLength) < 0 ||
+        sendData(socketFD, "Plaintext Received", strlen("Plaintext Received")) < 0 ||
+        recvJobData(socketFD, key, dataLength) < 0)
+    {
+        releaseJobInput(spool, input, 2 * dataLength, inMemory);
+        return;
+    }
+    if (checkKeyReuse(keyIndex, key, dataLength, clientAddress))
+    {
+        sendData(socketFD, "Key Reused", strlen("Key Reused"));         // refuse to encrypt with a used pad
+        releaseJobInput(spool, input, 2 * dataLength, inMemory);
+        return;
+    }
+
+    // the result file exists from here on so fetches see the job as pending
+    jobPath(spool, jobID, ".part", path);
+    int outputFD = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    char *ciphertext = MAP_FAILED;
+    if (outputFD >= 0 && ftruncate(outputFD, dataLength) == 0)
+        ciphertext = mmap(NULL, dataLength, PROT_READ | PROT_WRITE, MAP_SHARED, outputFD, 0);
+    if (ciphertext == MAP_FAILED)
+    {
+        perror("SERVER: ERROR creating job result");
+        if (outputFD >= 0)
+        {
+            close(outputFD);
+            unlink(path);
+        }
+        releaseJobInput(spool, input, 2 * dataLength, inMemory);
+        return;
+    }
+    close(outputFD);
+
+    // a grandchild does the work so it is not counted against the fork engine's connections.  The job ID is only
+    // sent once it has started, so a client is never handed an ID that cannot be fetched
+    switch (fork())
+    {
+    case -1:
+        perror("SERVER: ERROR starting job");
+        sendData(socketFD, "Not Started", strlen("Not Started"));          // anything but "Job <id>" fails the submit
+        munmap(ciphertext, dataLength);
+        unlink(path);
+        releaseJobInput(spool, input, 2 * dataLength, inMemory);
+        return;
+
+    case 0:
+        close(socketFD);
+        if (nice(10) < 0)                                                   // stay out of the way of interactive requests
+            perror("SERVER: WARNING: could not lower job priority");
+        if (binary)
+            xorData(plaintext, key, ciphertext, dataLength);
+        else
+            encryptData(plaintext, key, ciphertext, dataLength);
+        munmap(ciphertext, dataLength);
+        releaseJobInput(spool, input, 2 * dataLength, inMemory);
+        jobPath(spool, jobID, ".out", donePath);
+        if (rename(path, donePath) < 0)
+            perror("SERVER: ERROR completing job");
+        exit(0);
+
+    default:
+        munmap(ciphertext, dataLength);
+        munmap(input, 2 * dataLength);                                      // budget is given back by the job
+        snprintf(buffer, sizeof(buffer), "Job %s", jobID);
+        sendData(socketFD, buffer, strlen(buffer));
+        return;
+    }
+}
+
+// Streams a finished job's result back to the client and deletes it, or reports the job as pending or unknown
+void serveJobFetch(int socketFD, struct jobSpool *spool, const char *jobID)
+{
+    char buffer[MAX_TRANSMISSION_SIZE], path[PATH_MAX], partPath[PATH_MAX];
+    struct stat resultStat;
+
+    jobPath(spool, jobID, ".out", path);
+    int resultFD = open(path, O_RDONLY);
+    if (resultFD < 0)
+    {
+        jobPath(spool, jobID, ".part", partPath);
+        char *status = access(partPath, F_OK) == 0 ? "Job Pending" : "Job Unknown";
+        sendData(socketFD, status, strlen(status));
+        return;
+    }
+    fstat(resultFD, &resultStat);
+    snprintf(buffer, sizeof(buffer), "Job Done %ld", (long) resultStat.st_size);
+    if (sendData(socketFD, buffer, strlen(buffer)) < 0 || recvMessage(socketFD, buffer, sizeof(buffer)) <= 0)
+    {
+        close(resultFD);
+        return;
+    }
+
+    // sendfile() moves the result from the page cache to the socket without a copy through userspace
+    off_t offset = 0;
+    while (offset < resultStat.st_size)
+    {
+        ssize_t charsWritten = sendfile(socketFD, resultFD, &offset, resultStat.st_size - offset);
+        if (charsWritten <= 0)
+        {
+            perror("SERVER: ERROR sending job result");
+            close(resultFD);
+            return;
+        }
+    }
+    close(resultFD);
+    unlink(path);
+}
+
+/*-- Fork Engine --*/
+// Drives a request session over the blocking connection socket of a fork engine child process
+void serveForkRequest(int socketFD, in_addr_t clientAddress, struct rateLimiter *limiter, struct keyIndex *keyIndex,
+                      struct scheduler *sched, struct packetStats *packets, struct jobSpool *spool, char *plaintext,
+                      char *key, char *ciphertext)
+{
+    struct session s;
+    char buffer[MAX_TRANSMISSION_SIZE];
+    enum sessionAction action = ACTION_READ;
+    struct captureRecord capture;
+    sessionInit(&s, plaintext, key, ciphertext, clientAddress, limiter, keyIndex);
+    setNoDelay(socketFD);                                                   // status messages are flush points
+    captureStart(&capture);
+
+    while (1)
+    {
+        if (action == ACTION_ADMIT)
+        {
+            acquireSlot(sched, s.dataLength);                               // wait for a slot in the request's size class
+            action = sessionAdmit(&s);
+            captureProgress(&capture, &s);
+        }
+        if (action == ACTION_JOB)                                           // async job API takes the connection over
+        {
+            if (spool == NULL)
+                sendData(socketFD, "denied", strlen("denied"));
+            else if (s.job == JOB_SUBMIT)
+                serveJobSubmit(socketFD, spool, s.binary, clientAddress, limiter, keyIndex);
+            else
+                serveJobFetch(socketFD, spool, s.jobID);
+            break;
+        }
+
+        // send the reply as one corked buffer so it leaves in full segments, and uncork to flush
+        if (action == ACTION_REPLY)
+            setCork(socketFD, 1);
+        if (action != ACTION_READ && action != ACTION_CLOSE && sendData(socketFD, s.output, s.outputLen) < 0)
+            break;
+        if (action == ACTION_REPLY)
+        {
+            setCork(socketFD, 0);
+            recordPackets(packets, socketFD);
+        }
+        if (action == ACTION_REPLY || action == ACTION_SEND_CLOSE || action == ACTION_CLOSE)
+            break;
+
+        // receive payload straight into place, and other messages through the message buffer
+        int space, charsRead;
+        char *dest = sessionPayloadBuffer(&s, &space);
+        do
+            charsRead = dest != NULL ? recv(socketFD, dest, space, 0) : recv(socketFD, buffer, sizeof(buffer), 0);
+        while (charsRead < 0 && errno == EINTR);                            // prefork workers see SIGTERM mid request
+        if (charsRead <= 0)                                                 // client hung up (ie proxy health checks)
+            break;
+        action = sessionInput(&s, dest != NULL ? dest : buffer, charsRead);
+        captureProgress(&capture, &s);
+    }
+    captureFinish(&capture, &s);
+    close(socketFD);
+}
+
+/*-- Prefork Pool --*/
+// With "-P workers" the fork engine forks its request processes up front instead of one per connection.  Each worker
+// touches its request buffers before it starts accepting, so their page faults are paid once at startup rather than
+// on every request, then serves requests one after another straight from accept() on the shared listener.  After
+// -R requests a worker exits and the pool replaces it with a fresh one, so a leak or bloated heap never lives long.
+
+// Runs one pool worker, which tells the pool it is warm on readyFD (if given) and serves upto maxRequests requests
+// (0 for no limit), never returns
+void runPreforkWorker(int listenSocket, int maxRequests, int readyFD, struct rateLimiter *limiter,
+                      struct keyIndex *keyIndex, struct scheduler *sched, struct packetStats *packets,
+                      struct jobSpool *spool, char *plaintext, char *key, char *ciphertext)
+{
+    struct sockaddr_in clientAddress;
+    socklen_t sizeOfClientInfo = sizeof(clientAddress);
+    signal(SIGHUP, SIG_IGN);                                                // rate limits are reloaded by the pool
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);                                               // async jobs run on grandchildren nobody waits for
+
+    // fault the request buffers in now, copying them out of the pool's pages before any request is waiting
+    memset(plaintext, '\0', MAX_MSG_SIZE);
+    memset(key, '\0', MAX_MSG_SIZE);
+    memset(ciphertext, '\0', MAX_MSG_SIZE);
+    if (readyFD >= 0)
+    {
+        if (write(readyFD, "", 1) != 1)
+            perror("SERVER: WARNING: could not report worker ready");
+        close(readyFD);
+    }
+
+    // SIGTERM lets the request in flight finish, then the worker exits
+    int served = 0;
+    while (!stopRequested && (maxRequests <= 0 || served < maxRequests))
+    {
+        int connectionSocket = accept(listenSocket, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
+        if (connectionSocket < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (connectionSocket < 0)
+            error("ERROR on accept");
+        serveForkRequest(connectionSocket, clientAddress.sin_addr.s_addr, limiter, keyIndex, sched, packets, spool,
+                         plaintext, key, ciphertext);
+        releaseSlot(sched, getpid());
+        served++;
+    }
+    exit(0);
+}
+
+// Runs a pool of numWorkers prefork workers, replacing any that exit, and notifies readiness once every worker of
+// the first generation is warm.  Never returns
+void runPreforkPool(int listenSocket, int numWorkers, int maxRequests, char *readyTarget, struct rateLimiter *limiter,
+                    struct keyIndex *keyIndex, struct scheduler *sched, struct packetStats *packets,
+                    struct jobSpool *spool, char *plaintext, char *key, char *ciphertext)
+{
+    int childStatus, readyPipe[2];
+    ssize_t charsRead;
+    char byte;
+    pid_t pid, *workers = calloc(numWorkers, sizeof(pid_t));
+    if (workers == NULL || pipe(readyPipe) < 0)
+        error("ERROR creating prefork pool");
+
+    while (1)
+    {
+        // start workers for empty slots, only the first generation reports in on the ready pipe
+        for (int i = 0; i < numWorkers && !stopRequested; i++)
+        {
+            if (workers[i] > 0)
+                continue;
+            workers[i] = fork();
+            if (workers[i] == 0)
+            {
+                if (readyPipe[0] >= 0)
+                    close(readyPipe[0]);
+                runPreforkWorker(listenSocket, maxRequests, readyPipe[1], limiter, keyIndex, sched, packets, spool,
+                                 plaintext, key, ciphertext);
+            }
+            if (workers[i] < 0)
+                perror("fork()\n");
+        }
+
+        // each worker closes its end of the pipe once warm (or by dying), so EOF means the whole pool is up
+        if (readyPipe[0] >= 0)
+        {
+            close(readyPipe[1]);
+            do
+                charsRead = read(readyPipe[0], &byte, 1);
+            while (charsRead > 0 || (charsRead < 0 && errno == EINTR));
+            close(readyPipe[0]);
+            readyPipe[0] = readyPipe[1] = -1;
+            notifyReady(readyTarget);
+        }
+
+        if (stopRequested)
+            break;
+        if (statsRequested)
+        {
+            statsRequested = 0;
+            printSchedulerStats(sched);
+            printPacketStats(packets);
+        }
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            loadRateLimits(limiter);
+        }
+
+        // reap recycled or crashed workers so the next pass replaces them
+        pid = wait(&childStatus);
+        for (int i = 0; i < numWorkers && pid > 0; i++)
+        {
+            if (workers[i] != pid)
+                continue;
+            if (!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0)
+                fprintf(stderr, "SERVER: prefork worker %d died, replacing it\n", pid);
+            releaseSlot(sched, pid);                                        // frees the slot of a request it dropped
+            workers[i] = 0;
+        }
+        if (pid < 0 && errno == ECHILD)                                     // every fork failed, back off and retry
+            sleep(1);
+    }
+
+    // pass shutdown along to the workers and wait for their requests to finish
+    for (int i = 0; i < numWorkers; i++)
+    {
+        if (workers[i] > 0)
+            kill(workers[i], SIGTERM);
+    }
+    for (int i = 0; i < numWorkers; i++)
+    {
+        while (workers[i] > 0 && waitpid(workers[i], &childStatus, 0) < 0 && errno == EINTR);
+    }
+    exit(0);
+}
+
+/*-- io_uring Engine --*/
+// Alternative to forking a process per request - a single process drives every connection through io_uring with
+// a multishot accept, receives into a ring of provided buffers, sends status messages linked to the following
+// receive and writes replies from a registered buffer.  Each connection's request runs in its own session.
+//
+// Small text requests go into a request batch once their data is in.  The batch is run when it is full, or at the
+// end of a pass over the completion queue once it has waited maxDelayUs - a timeout wakes the engine if nothing else
+// does - so with no delay allowed only requests which became ready together are batched and none are held back.
+
+// io_uring operation of each request, stored in the low bits of its user_data with the connection index above them
+enum uringOp { URING_ACCEPT, URING_RECV, URING_SEND, URING_WRITE, URING_CLOSE, URING_CANCEL, URING_TIMEOUT };
+
+struct uringConn
+{
+    int socketFD;                                    // connection socket, -1 when the slot is free
+    int closing;                                     // 1 once a close has been queued
+    struct session session;
+    struct captureRecord capture;                    // phase timings for the capture file
+    int written;                                     // ciphertext chars sent so far
+    char *plaintext;                                 // only allocated once a request uses the slot
+    char *key;
+    char *ciphertext;                                // slice of the registered reply buffer
+};
+
+struct uring
+{
+    int ringFD;
+    unsigned entries;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit;                               // sqes queued since the last io_uring_enter
+    struct io_uring_buf_ring *bufRing;               // provided receive buffers
+    char *recvBufs;
+    int fixedReplies;                                // 1 if reply buffer was registered with the ring
+    struct rateLimiter *limiter;
+    struct packetStats *packets;
+    struct keyIndex *keyIndex;                       // NULL unless key reuse detection is on
+    struct cipherBatch *batch;
+    int batchTimerArmed;                             // 1 while a timeout is queued to run a waiting batch
+    struct __kernel_timespec batchTimeout;
+    struct uringConn conns[URING_MAX_CONNS];
+};
+
+// Hands a receive buffer back to the kernel once its data has been handled
+void returnRecvBuf(struct uring *u, int bufferID)
+{
+    unsigned short tail = u->bufRing->tail;
+    struct io_uring_buf *buf = &u->bufRing->bufs[tail & (URING_RECV_BUFS - 1)];
+    buf->addr = (unsigned long) (u->recvBufs + (size_t) bufferID * URING_RECV_BUF_SIZE);
+    buf->len = URING_RECV_BUF_SIZE;
+    buf->bid = bufferID;
+    __atomic_store_n(&u->bufRing->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Sets up the ring, its provided receive buffers and the registered reply buffer
+void setupUring(struct uring *u)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    u->ringFD = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (u->ringFD < 0)
+        error("ERROR setting up io_uring");
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        fprintf(stderr, "SERVER: io_uring engine needs a newer kernel\n");
+        exit(1);
+    }
+
+    // map the shared submission / completion rings and the submission entries
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringSize = sqSize > cqSize ? sqSize : cqSize;
+    char *ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ringFD, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->ringFD, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || u->sqes == MAP_FAILED)
+        error("ERROR mapping io_uring");
+    u->entries = params.sq_entries;
+    u->sqHead = (unsigned *)(ring + params.sq_off.head);
+    u->sqTail = (unsigned *)(ring + params.sq_off.tail);
+    u->sqMask = (unsigned *)(ring + params.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(ring + params.sq_off.array);
+    u->cqHead = (unsigned *)(ring + params.cq_off.head);
+    u->cqTail = (unsigned *)(ring + params.cq_off.tail);
+    u->cqMask = (unsigned *)(ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    u->toSubmit = 0;
+
+    // register a ring of provided buffers for receives so buffers are only tied up while data is being handled
+    u->bufRing = mmap(NULL, URING_RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->recvBufs = malloc(URING_RECV_BUFS * URING_RECV_BUF_SIZE);
+    if (u->bufRing == MAP_FAILED || u->recvBufs == NULL)
+        error("ERROR allocating receive buffers");
+    struct io_uring_buf_reg bufReg;
+    memset(&bufReg, 0, sizeof(bufReg));
+    bufReg.ring_addr = (unsigned long) u->bufRing;
+    bufReg.ring_entries = URING_RECV_BUFS;
+    bufReg.bgid = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, u->ringFD, IORING_REGISTER_PBUF_RING, &bufReg, 1) < 0)
+        error("ERROR registering receive buffers");
+    u->bufRing->tail = 0;
+    for (int i = 0; i < URING_RECV_BUFS; i++)
+    {
+        returnRecvBuf(u, i);
+    }
+
+    // register one reply buffer sliced up between connections so replies are written without page pinning per op
+    char *replies = malloc((size_t) URING_MAX_CONNS * MAX_MSG_SIZE);
+    if (replies == NULL)
+        error("ERROR allocating reply buffers");
+    struct iovec replyVec = {replies, (size_t) URING_MAX_CONNS * MAX_MSG_SIZE};
+    u->fixedReplies = syscall(__NR_io_uring_register, u->ringFD, IORING_REGISTER_BUFFERS, &replyVec, 1) == 0;
+    if (!u->fixedReplies)                            // ie locked memory limit too low, fall back on plain sends
+    {
+        fprintf(stderr, "SERVER: WARNING: could not register reply buffers, using plain sends\n");
+    }
+
+    for (int i = 0; i < URING_MAX_CONNS; i++)
+    {
+        u->conns[i].socketFD = -1;
+        u->conns[i].plaintext = NULL;
+        u->conns[i].key = NULL;
+        u->conns[i].ciphertext = replies + (size_t) i * MAX_MSG_SIZE;
+    }
+}
+
+// Gets the next free submission entry, submitting queued entries first if the queue is full
+struct io_uring_sqe *getSqe(struct uring *u, enum uringOp op, int connIndex)
+{
+    unsigned tail = *u->sqTail;
+    if (tail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->entries)
+    {
+        if (syscall(__NR_io_uring_enter, u->ringFD, u->toSubmit, 0, 0, NULL, 0) < 0)
+            error("ERROR submitting to io_uring");
+        u->toSubmit = 0;
+    }
+    unsigned index = tail & *u->sqMask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = ((unsigned long) connIndex << 8) | op;
+    u->sqArray[index] = index;
+    __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+    u->toSubmit++;
+    return sqe;
+}
+
+// Queues a receive into one of the provided buffers
+void submitRecv(struct uring *u, int connIndex)
+{
+    struct io_uring_sqe *sqe = getSqe(u, URING_RECV, connIndex);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = u->conns[connIndex].socketFD;
+    sqe->len = URING_RECV_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+}
+
+// Queues a close of the connection, its slot is freed once the close completes
+void submitClose(struct uring *u, int connIndex)
+{
+    struct io_uring_sqe *sqe = getSqe(u, URING_CLOSE, connIndex);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = u->conns[connIndex].socketFD;
+    u->conns[connIndex].closing = 1;
+}
+
+// Queues the session's status message followed by a linked receive (or close) so the next step costs no extra
+// round trip
+void submitStatus(struct uring *u, int connIndex, int thenClose)
+{
+    struct io_uring_sqe *sqe = getSqe(u, URING_SEND, connIndex);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = u->conns[connIndex].socketFD;
+    sqe->addr = (unsigned long) u->conns[connIndex].session.output;
+    sqe->len = u->conns[connIndex].session.outputLen;
+    sqe->flags = IOSQE_IO_LINK;
+    if (thenClose)
+    {
+        submitClose(u, connIndex);
+    }
+    else
+    {
+        submitRecv(u, connIndex);
+    }
+}
+
+// Queues the rest of the ciphertext to be written back to the client
+void submitCiphertext(struct uring *u, int connIndex)
+{
+    struct uringConn *conn = &u->conns[connIndex];
+    struct io_uring_sqe *sqe = getSqe(u, URING_WRITE, connIndex);
+    sqe->fd = conn->socketFD;
+    sqe->addr = (unsigned long) (conn->session.output + conn->written);
+    sqe->len = conn->session.outputLen - conn->written;
+    if (u->fixedReplies)
+    {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = 0;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_SEND;
+    }
+}
+
+// Runs the request batch and queues the reply of every request in it
+void runUringBatch(struct uring *u)
+{
+    int count = batchRun(u->batch);
+    for (int i = 0; i < count; i++)
+    {
+        u->conns[u->batch->tags[i]].written = 0;
+        submitCiphertext(u, u->batch->tags[i]);
+    }
+}
+
+// Queues a timeout to wake the engine once the waiting batch is due, unless one is already queued
+void armBatchTimer(struct uring *u, long delayUs)
+{
+    if (u->batchTimerArmed)
+        return;
+    u->batchTimeout.tv_sec = delayUs / 1000000;
+    u->batchTimeout.tv_nsec = delayUs % 1000000 * 1000;
+    struct io_uring_sqe *sqe = getSqe(u, URING_TIMEOUT, 0);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long) &u->batchTimeout;
+    sqe->len = 1;
+    u->batchTimerArmed = 1;
+}
+
+// Carries out what a connection's session asked for next
+void handleSessionAction(struct uring *u, int connIndex, enum sessionAction action)
+{
+    struct uringConn *conn = &u->conns[connIndex];
+    if (action == ACTION_ADMIT)                      // io_uring engine does not schedule by size, admit right away
+    {
+        action = sessionAdmit(&conn->session);
+        captureProgress(&conn->capture, &conn->session);
+    }
+
+    switch (action)
+    {
+    case ACTION_READ:
+        submitRecv(u, connIndex);
+        break;
+    case ACTION_SEND:
+        submitStatus(u, connIndex, 0);
+        break;
+    case ACTION_SEND_CLOSE:
+        submitStatus(u, connIndex, 1);
+        break;
+    case ACTION_REPLY:
+        conn->written = 0;
+        submitCiphertext(u, connIndex);
+        break;
+    case ACTION_BATCH:
+        if (!batchAdd(u->batch, &conn->session, connIndex))                 // too large to batch, cipher it now
+            handleSessionAction(u, connIndex, sessionReply(&conn->session, 0));
+        else if (u->batch->count == u->batch->maxCount)
+            runUringBatch(u);
+        break;
+    case ACTION_JOB:                                 // async jobs are only served by the fork engine
+        sessionStatus(&conn->session, "denied", ACTION_SEND_CLOSE);
+        submitStatus(u, connIndex, 1);
+        break;
+    default:
+        submitClose(u, connIndex);
+        break;
+    }
+}
+
+// Handles a single completion from the ring
+void handleUringCompletion(struct uring *u, struct io_uring_cqe *cqe, int listenSocket)
+{
+    enum uringOp op = cqe->user_data & 0xff;
+    int connIndex = cqe->user_data >> 8;
+    struct uringConn *conn = &u->conns[connIndex];
+
+    switch (op)
+    {
+    case URING_ACCEPT:
+        if (!(cqe->flags & IORING_CQE_F_MORE) && !stopRequested)    // multishot accept was stopped, re-arm it
+        {
+            struct io_uring_sqe *sqe = getSqe(u, URING_ACCEPT, 0);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listenSocket;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        }
+        if (cqe->res < 0)
+        {
+            if (cqe->res != -ECANCELED)              // accept is cancelled on purpose when stopping
+                fprintf(stderr, "SERVER: ERROR on accept: %s\n", strerror(-cqe->res));
+            break;
+        }
+        // find a free connection slot, dropping the connection if all are busy
+        for (connIndex = 0; connIndex < URING_MAX_CONNS && u->conns[connIndex].socketFD >= 0; connIndex++);
+        if (connIndex == URING_MAX_CONNS)
+        {
+            close(cqe->res);
+            break;
+        }
+        conn = &u->conns[connIndex];
+        if (conn->plaintext == NULL)                 // connection slots keep their buffers once allocated
+        {
+            conn->plaintext = malloc(MAX_MSG_SIZE);
+            conn->key = malloc(MAX_MSG_SIZE);
+            if (conn->plaintext == NULL || conn->key == NULL)
+                error("ERROR allocating connection buffers");
+        }
+        conn->socketFD = cqe->res;
+        conn->closing = 0;
+        setNoDelay(cqe->res);
+        struct sockaddr_in clientAddress;
+        socklen_t sizeOfClientInfo = sizeof(clientAddress);
+        getpeername(cqe->res, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
+        sessionInit(&conn->session, conn->plaintext, conn->key, conn->ciphertext, clientAddress.sin_addr.s_addr,
+                    u->limiter, u->keyIndex);
+        conn->session.batchCipher = u->batch->maxCount > 1;
+        captureStart(&conn->capture);
+        submitRecv(u, connIndex);
+        break;
+
+    case URING_RECV:
+        if (cqe->res == -ENOBUFS)                    // all receive buffers in use, try again
+        {
+            submitRecv(u, connIndex);
+        }
+        else if (cqe->res <= 0)                      // client hung up, or the linked status send failed
+        {
+            if (!conn->closing)
+                submitClose(u, connIndex);
+        }
+        else
+        {
+            int bufferID = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            char *data = u->recvBufs + (size_t) bufferID * URING_RECV_BUF_SIZE;
+            enum sessionAction action = sessionInput(&conn->session, data, cqe->res);
+            captureProgress(&conn->capture, &conn->session);
+            handleSessionAction(u, connIndex, action);
+            returnRecvBuf(u, bufferID);
+        }
+        break;
+
+    case URING_SEND:
+        if (cqe->res < 0 && cqe->res != -ECANCELED)
+        {
+            fprintf(stderr,"SERVER: ERROR writing to socket: %s\n", strerror(-cqe->res));
+        }
+        break;
+
+    case URING_WRITE:
+        if (cqe->res <= 0)
+        {
+            submitClose(u, connIndex);
+            break;
+        }
+        conn->written += cqe->res;
+        if (conn->written < conn->session.outputLen) // short write, send the rest
+        {
+            submitCiphertext(u, connIndex);
+            break;
+        }
+        recordPackets(u->packets, conn->socketFD);
+        submitClose(u, connIndex);
+        break;
+
+    case URING_CANCEL:
+        break;
+
+    case URING_TIMEOUT:                              // waiting batch may be due, checked after this pass
+        u->batchTimerArmed = 0;
+        break;
+
+    case URING_CLOSE:
+        if (cqe->res == -ECANCELED)                  // close was linked to a failed send, close it directly
+            close(conn->socketFD);
+        captureFinish(&conn->capture, &conn->session);
+        conn->socketFD = -1;
+        break;
+    }
+}
+
+// Runs the io_uring engine on the listening socket, never returns
+void runUringEngine(int listenSocket, struct rateLimiter *limiter, struct keyIndex *keyIndex,
+                    struct packetStats *packets, struct cipherBatch *batch)
+{
+    struct uring *u = malloc(sizeof(struct uring));
+    if (u == NULL)
+        error("ERROR allocating io_uring engine");
+    setupUring(u);
+    u->limiter = limiter;
+    u->packets = packets;
+    u->keyIndex = keyIndex;
+    u->batch = batch;
+    u->batchTimerArmed = 0;
+
+    // a single multishot accept keeps producing connections
+    struct io_uring_sqe *sqe = getSqe(u, URING_ACCEPT, 0);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+
+    int draining = 0;
+    while (1)
+    {
+        if (statsRequested)
+        {
+            statsRequested = 0;
+            printPacketStats(packets);
+        }
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            loadRateLimits(limiter);
+        }
+
+        // once asked to stop, cancel the accept and exit after every open connection has finished
+        if (stopRequested && !draining)
+        {
+            sqe = getSqe(u, URING_CANCEL, 0);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = URING_ACCEPT;                // user_data of the multishot accept
+            draining = 1;
+        }
+        if (draining)
+        {
+            int activeConns = 0;
+            for (int i = 0; i < URING_MAX_CONNS; i++)
+            {
+                activeConns += u->conns[i].socketFD >= 0;
+            }
+            if (activeConns == 0)
+                exit(0);
+        }
+
+        // submit everything queued and wait for at least one completion in the same call
+        if (syscall(__NR_io_uring_enter, u->ringFD, u->toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            error("ERROR waiting on io_uring");
+        u->toSubmit = 0;
+
+        unsigned head = *u->cqHead;
+        while (head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE))
+        {
+            handleUringCompletion(u, &u->cqes[head & *u->cqMask], listenSocket);
+            head++;
+        }
+        __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+
+        // run the batch once it has waited as long as it may, or have the engine woken when it will have
+        if (u->batch->count > 0)
+        {
+            long waitedUs = nowUs() - u->batch->startedUs;
+            if (waitedUs >= u->batch->maxDelayUs)
+                runUringBatch(u);
+            else
+                armBatchTimer(u, u->batch->maxDelayUs - waitedUs);
+        }
+    }
+}
+
+/*-- Shared Memory Ring Transport --*/
+// With "-m path" co-located clients can skip sockets for small requests.  A client connects once to the unix socket
+// at path and is handed a memfd holding its own channel: a submission ring of requests and a completion ring of
+// replies, each single producer / single consumer.  A process per client serves the submission ring, running each
+// request through a request session in place in the shared slots.  Waiting on a ring spins first and only sleeps on
+// a futex once spinning stops paying off, so a busy client sees no syscalls at all in steady state.
+
+// Outcome of a shared memory request
+enum shmStatus { SHM_DONE, SHM_INVALID, SHM_THROTTLED, SHM_KEY_REUSED };
+
+struct shmRequest
+{
+    int len;                                         // chars of plaintext and key
+    int binary;                                      // 1 for the binary pad
+    char plaintext[SHM_MAX_DATA];
+    char key[SHM_MAX_DATA];
+};
+
+struct shmReply
+{
+    int status;                                      // shmStatus of the request
+    int len;                                         // chars of ciphertext, or ms to wait for SHM_THROTTLED
+    char ciphertext[SHM_MAX_DATA];
+};
+
+// Producer and consumer indexes count up forever and are masked into slots, each on its own cache line
+struct shmRing
+{
+    uint32_t tail __attribute__((aligned(64)));      // slots published by the producer, also the futex word
+    uint32_t sleeping;                               // 1 while the consumer is asleep on tail
+    uint32_t head __attribute__((aligned(64)));      // slots taken by the consumer
+};
+
+struct shmChannel
+{
+    char magic[8];                                   // "OTPRING1", checked by clients
+    struct shmRing submit __attribute__((aligned(64)));
+    struct shmRing complete;
+    struct shmRequest requests[SHM_RING_SLOTS];
+    struct shmReply replies[SHM_RING_SLOTS];
+};
+
+// Waits for the ring's tail to move on from seen, spinning for upto spinBudget checks before sleeping on a futex
+// for upto timeoutMs.  The budget doubles when spinning catches the change and halves when it ends in a sleep.
+// Returns 0 if it timed out
+int shmWait(struct shmRing *ring, uint32_t seen, int *spinBudget, int timeoutMs)
+{
+    for (int i = 0; i < *spinBudget; i++)
+    {
+        if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != seen)
+        {
+            *spinBudget = *spinBudget < SHM_MAX_SPIN ? *spinBudget * 2 : SHM_MAX_SPIN;
+            return 1;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();                      // ease off the sibling hyperthread while spinning
+#endif
+    }
+    *spinBudget = *spinBudget > SHM_MIN_SPIN ? *spinBudget / 2 : SHM_MIN_SPIN;
+
+    // announce the sleep before the last check so a producer publishing in between knows to wake us
+    struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == seen)
+        syscall(SYS_futex, &ring->tail, FUTEX_WAIT, seen, &timeout, NULL, 0);
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != seen;
+}
+
+// Publishes the ring's slots upto newTail, waking the consumer only if it went to sleep
+void shmPublish(struct shmRing *ring, uint32_t newTail)
+{
+    __atomic_store_n(&ring->tail, newTail, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Runs one request from the submission ring through a session, encrypting straight from the shared request slot
+// into the shared reply slot
+void serveShmRequest(struct session *s, struct shmRequest *request, struct shmReply *reply,
+                     struct rateLimiter *limiter, struct keyIndex *keyIndex, uid_t clientUid)
+{
+    char lengthMsg[16];
+    int len = request->len;                          // read once, the client can write the slot at any time
+    if (len <= 0 || len > SHM_MAX_DATA)
+    {
+        reply->status = SHM_INVALID;
+        return;
+    }
+
+    // step the session through the same messages a socket client sends, with payload already in place
+    char *type = request->binary ? "enc_server binary" : "enc_server";
+    sessionInit(s, request->plaintext, request->key, reply->ciphertext, htonl(INADDR_LOOPBACK), limiter, keyIndex);
+    s->rateClient = RATE_UID_CLIENT | clientUid;    // every ring client is local, so limits go by uid
+    enum sessionAction action = sessionInput(s, type, strlen(type));
+    if (action == ACTION_SEND)
+        action = sessionInput(s, lengthMsg, sprintf(lengthMsg, "%d", len));
+    if (action == ACTION_ADMIT)                      // ring depth already bounds each client's requests
+        action = sessionAdmit(s);
+    if (action == ACTION_SEND)
+        action = sessionInput(s, request->plaintext, len);
+    if (action == ACTION_SEND)
+        action = sessionInput(s, request->key, len);
+    if (action == ACTION_SEND)
+        action = sessionInput(s, "Waiting for ciphertext..", strlen("Waiting for ciphertext.."));
+
+    reply->len = 0;
+    if (action == ACTION_REPLY)
+    {
+        reply->status = SHM_DONE;
+        reply->len = len;
+    }
+    else if (action == ACTION_SEND_CLOSE && sscanf(s->output, "throttled %d", &reply->len) == 1)
+        reply->status = SHM_THROTTLED;
+    else if (action == ACTION_SEND_CLOSE && strcmp(s->output, "Key Reused") == 0)
+        reply->status = SHM_KEY_REUSED;
+    else
+        reply->status = SHM_INVALID;
+}
+
+// Hands a client its channel over the unix socket and serves its submission ring until it hangs up, never returns
+void serveShmClient(int clientSocket, struct rateLimiter *limiter, struct keyIndex *keyIndex)
+{
+    struct session s;
+    struct ucred peer;
+    socklen_t peerLen = sizeof(peer);
+    int spinBudget = SHM_MIN_SPIN;
+    if (getsockopt(clientSocket, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen) < 0)
+        exit(0);                                     // rate limits need to know who the client is
+    int channelFD = memfd_create("otp_ring", MFD_CLOEXEC);
+    if (channelFD < 0 || ftruncate(channelFD, sizeof(struct shmChannel)) < 0)
+        error("ERROR creating shared memory channel");
+    struct shmChannel *channel = mmap(NULL, sizeof(struct shmChannel), PROT_READ | PROT_WRITE, MAP_SHARED,
+                                      channelFD, 0);
+    if (channel == MAP_FAILED)
+        error("ERROR mapping shared memory channel");
+    memcpy(channel->magic, "OTPRING1", 8);
+
+    // pass the memfd over as SCM_RIGHTS ancillary data
+    char byte = 0, control[CMSG_SPACE(sizeof(int))];
+    struct iovec byteVec = {&byte, 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &byteVec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &channelFD, sizeof(int));
+    if (sendmsg(clientSocket, &msg, MSG_NOSIGNAL) < 0)
+        exit(0);
+    close(channelFD);
+
+    uint32_t head = 0, completeTail = 0;
+    while (1)
+    {
+        // idle - only checks whether the client has gone once a wait times out
+        uint32_t tail = __atomic_load_n(&channel->submit.tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            if (!shmWait(&channel->submit, tail, &spinBudget, 100) &&
+                recv(clientSocket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+                exit(0);
+            continue;
+        }
+        if (completeTail - __atomic_load_n(&channel->complete.head, __ATOMIC_ACQUIRE) >= SHM_RING_SLOTS)
+        {
+            usleep(100);                                                    // client is behind on taking replies
+            if (recv(clientSocket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+                exit(0);
+            continue;
+        }
+        serveShmRequest(&s, &channel->requests[head % SHM_RING_SLOTS],
+                        &channel->replies[completeTail % SHM_RING_SLOTS], limiter, keyIndex, peer.uid);
+        __atomic_store_n(&channel->submit.head, ++head, __ATOMIC_RELEASE);
+        shmPublish(&channel->complete, ++completeTail);
+    }
+}
+
+// Starts the shared memory transport on the unix socket at path in a process of its own, which forks a process
+// per client.  Both end with the server
+void startShmTransport(char *path, struct rateLimiter *limiter, struct keyIndex *keyIndex)
+{
+    struct sockaddr_un address;
+    if (path == NULL)
+        return;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);                                    // clear out a socket left behind by an earlier server
+    if (listenSocket < 0 || bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listenSocket, 16) < 0)
+        error("ERROR opening shared memory transport socket");
+
+    pid_t serverPid = getpid();
+    switch (fork())
+    {
+    case -1:
+        error("ERROR starting shared memory transport");
+
+    case 0:
+        break;
+
+    default:
+        close(listenSocket);
+        return;
+    }
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);                // transport goes away with the server
+    if (getppid() != serverPid)
+        exit(0);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);                        // client processes are reaped automatically
+    while (1)
+    {
+        int clientSocket = accept(listenSocket, NULL, NULL);
+        if (clientSocket < 0)
+            continue;
+        switch (fork())
+        {
+        case 0:
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            close(listenSocket);
+            serveShmClient(clientSocket, limiter, keyIndex);
+
+        default:
+            close(clientSocket);
+        }
+    }
+}
+
+/*-- In-Process Bench and Fuzz Engines --*/
+// Drive request sessions directly, with no sockets.  "-e bench" times requests of a given size through a session
+// and "-e fuzz" feeds sessions valid, mangled and random messages, checking they only ever ask for sane output.
+
+// Fills buffer with len random A-Z or SPACE chars
+void fillRandomText(char *buffer, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        buffer[i] = itoc(rand() % CIPHER_TEXT_MOD);
+    }
+}
+
+// Runs requests of requestSize chars through a session for about a second and prints the rate, then does the same
+// with the ciphers run batchSize requests at a time as the io_uring engine does, never returns
+void runBenchEngine(int requestSize, int batchSize, struct rateLimiter *limiter)
+{
+    char *buffers = malloc((size_t) 5 * MAX_MSG_SIZE);
+    char lengthMsg[32];
+    long requests = 0;
+    if (buffers == NULL)
+        error("ERROR allocating bench buffers");
+    if (requestSize <= 0 || requestSize >= MAX_MSG_SIZE)
+    {
+        fprintf(stderr, "Error: bench request size must be 1-%d\n", MAX_MSG_SIZE - 1);
+        exit(1);
+    }
+    char *inPlaintext = buffers + 3 * MAX_MSG_SIZE, *inKey = buffers + 4 * MAX_MSG_SIZE;
+    fillRandomText(inPlaintext, requestSize);
+    fillRandomText(inKey, requestSize);
+    sprintf(lengthMsg, "%d", requestSize);
+
+    long startUs = nowUs();
+    while (nowUs() - startUs < 1000000)
+    {
+        for (int batch = 0; batch < 64; batch++, requests++)
+        {
+            struct session s;
+            sessionInit(&s, buffers, buffers + MAX_MSG_SIZE, buffers + 2 * MAX_MSG_SIZE, htonl(INADDR_LOOPBACK),
+                        limiter, NULL);
+            sessionInput(&s, "enc_server", strlen("enc_server"));
+            if (sessionInput(&s, lengthMsg, strlen(lengthMsg)) == ACTION_ADMIT)
+                sessionAdmit(&s);
+            sessionInput(&s, inPlaintext, requestSize);
+            sessionInput(&s, inKey, requestSize);
+            if (sessionInput(&s, "Waiting for ciphertext..", 24) != ACTION_REPLY)
+            {
+                fprintf(stderr, "SERVER: bench request did not complete (rate limited?)\n");
+                exit(1);
+            }
+        }
+    }
+    double seconds = (nowUs() - startUs) / 1e6;
+    printf("SERVER: bench: %ld requests of %d chars, %.0f requests/s, %.1f MB/s\n", requests, requestSize,
+           requests / seconds, requests * (double) requestSize / seconds / 1e6);
+    if (batchSize <= 1)
+        exit(0);
+
+    // batched sessions each need their own buffers, as their data is only gathered once all of it is in
+    struct cipherBatch *batch = createCipherBatch(batchSize, requestSize, 0);
+    struct session *sessions = malloc(batchSize * sizeof(struct session));
+    char *batchBuffers = malloc((size_t) 3 * batchSize * requestSize);
+    if (sessions == NULL || batchBuffers == NULL)
+        error("ERROR allocating bench buffers");
+    requests = 0;
+    startUs = nowUs();
+    while (nowUs() - startUs < 1000000)
+    {
+        for (int i = 0; i < batchSize; i++, requests++)
+        {
+            struct session *s = &sessions[i];
+            char *buffer = batchBuffers + (size_t) 3 * i * requestSize;
+            sessionInit(s, buffer, buffer + requestSize, buffer + 2 * requestSize, htonl(INADDR_LOOPBACK), limiter,
+                        NULL);
+            s->batchCipher = 1;
+            sessionInput(s, "enc_server", strlen("enc_server"));
+            if (sessionInput(s, lengthMsg, strlen(lengthMsg)) == ACTION_ADMIT)
+                sessionAdmit(s);
+            sessionInput(s, inPlaintext, requestSize);
+            sessionInput(s, inKey, requestSize);
+            if (sessionInput(s, "Waiting for ciphertext..", 24) != ACTION_BATCH || !batchAdd(batch, s, i))
+            {
+                fprintf(stderr, "SERVER: bench request did not complete (rate limited?)\n");
+                exit(1);
+            }
+        }
+        batchRun(batch);
+    }
+    seconds = (nowUs() - startUs) / 1e6;
+    printf("SERVER: bench: %ld requests of %d chars in batches of %d, %.0f requests/s, %.1f MB/s\n", requests,
+           requestSize, batchSize, requests / seconds, requests * (double) requestSize / seconds / 1e6);
+    exit(0);
+}
+
+// Checks a session only asks for sane output, aborting if it does not
+void checkSession(struct session *s, enum sessionAction action)
+{
+    int sends = action == ACTION_SEND || action == ACTION_REPLY || action == ACTION_SEND_CLOSE;
+    if ((sends && (s->output == NULL || s->outputLen <= 0 || s->outputLen >= MAX_MSG_SIZE)) ||
+        s->dataLength < 0 || s->dataLength >= MAX_MSG_SIZE || s->received < 0 || s->received > s->dataLength)
+    {
+        fprintf(stderr, "SERVER: fuzz: session fault in state %d after action %d\n", s->state, action);
+        abort();
+    }
+}
+
+// Feeds iterations sessions random sequences of valid, mangled and random messages, never returns
+void runFuzzEngine(int iterations, struct rateLimiter *limiter)
+{
+    static const char *readyMsg = "Waiting for ciphertext..";
+    char *buffers = malloc((size_t) 4 * MAX_MSG_SIZE);
+    long inputs = 0, replies = 0;
+    unsigned seed = time(0);
+    if (buffers == NULL)
+        error("ERROR allocating fuzz buffers");
+    char *input = buffers + 3 * MAX_MSG_SIZE;
+    srand(seed);
+
+    for (int i = 0; i < iterations; i++)
+    {
+        struct session s;
+        enum sessionAction action = ACTION_READ;
+        sessionInit(&s, buffers, buffers + MAX_MSG_SIZE, buffers + 2 * MAX_MSG_SIZE, htonl(INADDR_LOOPBACK),
+                    limiter, NULL);
+        for (int step = 0; step < 64 && (action == ACTION_READ || action == ACTION_SEND || action == ACTION_ADMIT);
+             step++)
+        {
+            if (action == ACTION_ADMIT)
+            {
+                action = sessionAdmit(&s);
+                checkSession(&s, action);
+                continue;
+            }
+
+            // mostly send what the phase expects so sessions get deep, otherwise random bytes
+            int len, kind = rand() % 4;
+            if (kind == 3)
+            {
+                len = rand() % (rand() % 8 == 0 ? MAX_MSG_SIZE : 64);
+                for (int c = 0; c < len; c++)
+                    input[c] = rand();
+            }
+            else if (s.state == SESSION_TYPE)
+                len = sprintf(input, "%s", rand() % 4 ? "enc_server" : "enc_server binary");
+            else if (s.state == SESSION_LENGTH)
+                len = sprintf(input, "%d", rand() % 8 ? rand() % 2048 + 1 : rand() - RAND_MAX / 2);
+            else if (s.state == SESSION_READY)
+                len = sprintf(input, "%s", readyMsg);
+            else
+            {
+                len = rand() % (s.dataLength - s.received + 16) + 1;
+                fillRandomText(input, len);
+            }
+            if (kind == 2 && len > 0)                                       // mangle a byte of an expected message
+                input[rand() % len] ^= 1 << (rand() % 8);
+
+            action = sessionInput(&s, input, len);
+            checkSession(&s, action);
+            inputs++;
+            replies += action == ACTION_REPLY;
+        }
+    }
+    printf("SERVER: fuzz: %d sessions (seed %u), %ld inputs, %ld replies, no faults\n", iterations, seed, inputs,
+           replies);
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int connectionSocket, activeConnections, childStatus;
+    char plaintext[MAX_MSG_SIZE];
+    char key[MAX_MSG_SIZE];
+    char ciphertext[MAX_MSG_SIZE];
+    struct sockaddr_in clientAddress;
+    socklen_t sizeOfClientInfo = sizeof(clientAddress);
+    pid_t childPid;
+    int option, numWorkers = -1;
+    enum engine { ENGINE_FORK, ENGINE_URING, ENGINE_BENCH, ENGINE_FUZZ } engine = ENGINE_FORK;
+    int smallThreshold = 1024, smallLimit = 2, largeLimit = 5;
+    char *rateLimitsPath = NULL, *keyIndexPath = NULL;
+    int keyAlertOnly = 0;
+    char *jobDir = NULL;
+    long jobBudgetMB = 64;
+    char *shmPath = NULL;
+    char *capturePath = NULL;
+    int preforkWorkers = 0, recycleRequests = 1000;
+    char *readyTarget = NULL;
+    int batchSize = 32;
+    long batchDelayUs = 0;
+
+    /*-- Check usage & args --*/
+    while ((option = getopt(argc, argv, "e:w:t:s:l:r:K:AJ:M:m:P:R:N:B:D:c:")) != -1)
+    {
+        switch (option)
+        {
+        case 'e':                                   // request handling engine - fork (default), uring, or bench / fuzz
+            if (strcmp(optarg, "fork") == 0)
+                engine = ENGINE_FORK;
+            else if (strcmp(optarg, "uring") == 0)
+                engine = ENGINE_URING;
+            else if (strcmp(optarg, "bench") == 0)
+                engine = ENGINE_BENCH;
+            else if (strcmp(optarg, "fuzz") == 0)
+                engine = ENGINE_FUZZ;
+            else
+            {
+                fprintf(stderr,"Error: unknown engine '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'w':                                   // run as supervisor of this many workers, 0 for one per CPU
+            numWorkers = atoi(optarg);
+            break;
+        case 't':                                   // largest data length handled as a small request
+            smallThreshold = atoi(optarg);
+            break;
+        case 's':                                   // small requests allowed to run at once
+            smallLimit = atoi(optarg);
+            break;
+        case 'l':                                   // large requests allowed to run at once
+            largeLimit = atoi(optarg);
+            break;
+        case 'r':                                   // per client rate limits file
+            rateLimitsPath = optarg;
+            break;
+        case 'K':                                   // key reuse index file
+            keyIndexPath = optarg;
+            break;
+        case 'A':                                   // only log reused keys instead of rejecting them
+            keyAlertOnly = 1;
+            break;
+        case 'J':                                   // spool directory for async jobs
+            jobDir = optarg;
+            break;
+        case 'M':                                   // MB of async job input held in memory before spooling to disk
+            jobBudgetMB = atol(optarg);
+            break;
+        case 'm':                                   // unix socket for the shared memory ring transport
+            shmPath = optarg;
+            break;
+        case 'P':                                   // fork engine runs this many prefork workers
+            preforkWorkers = atoi(optarg);
+            break;
+        case 'R':                                   // requests served by a prefork worker before it is replaced, 0 for no limit
+            recycleRequests = atoi(optarg);
+            break;
+        case 'N':                                   // readiness file, or fd:N, written once the server can serve
+            readyTarget = optarg;
+            break;
+        case 'B':                                   // small requests the io_uring engine batches together, 1 for none
+            batchSize = atoi(optarg);
+            break;
+        case 'D':                                   // microseconds a batch may wait for more requests
+            batchDelayUs = atol(optarg);
+            break;
+        case 'c':                                   // capture file each request's metadata is appended to
+            capturePath = optarg;
+            break;
+        default:
+            fprintf(stderr,"USAGE: %s port [-e fork|uring] [-w workers] [-t smallsize] [-s smallslots] [-l largeslots] [-r ratelimits] [-K keyindex [-A]] [-J jobdir [-M budgetMB]] [-m ringsocket] [-P workers [-R recycle]] [-N readyfile|fd:N] [-B batchsize] [-D delayus] [-c capturefile]\n"
+                            "       %s -e bench requestsize | -e fuzz iterations\n", argv[0], argv[0]); 
+            exit(1);
+        }
+    }
+    if (optind >= argc) 
+    { 
+        fprintf(stderr,"USAGE: %s port [-e fork|uring] [-w workers] [-t smallsize] [-s smallslots] [-l largeslots] [-r ratelimits] [-K keyindex [-A]] [-J jobdir [-M budgetMB]] [-m ringsocket] [-P workers [-R recycle]] [-N readyfile|fd:N] [-B batchsize] [-D delayus] [-c capturefile]\n"
+                            "       %s -e bench requestsize | -e fuzz iterations\n", argv[0], argv[0]); 
+        exit(1);
+    }
+    
+    if (shmPath != NULL && numWorkers >= 0)        // workers would all try to own the one unix socket
+    {
+        fprintf(stderr,"Error: -m cannot be used with -w\n");
+        exit(1);
+    }
+    if (preforkWorkers < 0 || preforkWorkers > MAX_PENDING_REQUESTS || (preforkWorkers > 0 && engine != ENGINE_FORK))
+    {
+        fprintf(stderr,"Error: -P takes upto %d workers and only applies to the fork engine\n", MAX_PENDING_REQUESTS);
+        exit(1);
+    }
+    if (batchSize < 1 || batchSize > MAX_BATCH_REQUESTS || batchDelayUs < 0)
+    {
+        fprintf(stderr,"Error: -B takes 1-%d requests and -D a delay of 0 or more microseconds\n", MAX_BATCH_REQUESTS);
+        exit(1);
+    }
+
+    // the bench and fuzz engines run sessions in process, the positional arg is their request size / iterations
+    if (engine == ENGINE_BENCH)
+        runBenchEngine(atoi(argv[optind]), batchSize, createRateLimiter(rateLimitsPath));
+    if (engine == ENGINE_FUZZ)
+        runFuzzEngine(atoi(argv[optind]), createRateLimiter(rateLimitsPath));
+
+    /*-- Create and Bind Socket & Start Listening For Connections --*/
+    int listenSocket;
+    char *inheritedSocket = getenv("OTP_LISTEN_FD");
+    if (inheritedSocket != NULL)                    // started by a supervisor, which hands down listener and CPU
+    {
+        listenSocket = atoi(inheritedSocket);
+        pinToCpu(atoi(getenv("OTP_WORKER_CPU")));
+        readyTarget = getenv("OTP_READY_FD");       // readiness goes to the supervisor, which waits on it
+    }
+    else if (numWorkers >= 0)
+    {
+        resetReady(readyTarget);
+        createRateLimiter(rateLimitsPath);          // workers share it through OTP_LIMITER_FD
+        runSupervisor(atoi(argv[optind]), numWorkers, readyTarget, argv);
+    }
+    else
+    {
+        resetReady(readyTarget);
+        listenSocket = createListenSocket(atoi(argv[optind]), 0);
+    }
+
+    // SIGTERM stops accepting new requests and lets in flight requests finish, SIGHUP reloads rate limits and
+    // SIGUSR1 prints stats
+    installSignalHandler(SIGTERM, handleStopSignal);
+    installSignalHandler(SIGHUP, handleReloadSignal);
+    installSignalHandler(SIGUSR1, handleStatsSignal);
+    struct packetStats *packets = createPacketStats();
+    struct rateLimiter *limiter = createRateLimiter(rateLimitsPath);
+    struct keyIndex *keyIndex = openKeyIndex(keyIndexPath, keyAlertOnly);
+    struct jobSpool *spool = createJobSpool(jobDir, jobBudgetMB);
+    startShmTransport(shmPath, limiter, keyIndex);
+    openCapture(capturePath);
+
+    // hand the listening socket over to the io_uring engine if selected
+    if (engine == ENGINE_URING)
+    {
+        notifyReady(readyTarget);
+        int batchData = smallThreshold < 1 ? 1 : smallThreshold < MAX_MSG_SIZE ? smallThreshold : MAX_MSG_SIZE - 1;
+        runUringEngine(listenSocket, limiter, keyIndex, packets, createCipherBatch(batchSize, batchData, batchDelayUs));
+    }
+
+
+    /*-- Queue and Accept Upto MAX_PENDING_REQUESTS Connections, Scheduled by Size Class --*/
+    struct scheduler *sched = createScheduler(smallThreshold, smallLimit, largeLimit);
+    if (preforkWorkers > 0)
+    {
+        runPreforkPool(listenSocket, preforkWorkers, recycleRequests, readyTarget, limiter, keyIndex, sched, packets,
+                       spool, plaintext, key, ciphertext);
+    }
+    notifyReady(readyTarget);
+
+    // Set up perpetual loop for server service
+    activeConnections = 0;
+    while(!stopRequested){
+        if (statsRequested)
+        {
+            statsRequested = 0;
+            printSchedulerStats(sched);
+            printPacketStats(packets);
+        }
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            loadRateLimits(limiter);
+        }
+
+        // check num of active encryption requests, if already at the max, does not accept any new connections
+        if (activeConnections < MAX_PENDING_REQUESTS)
+        {
+            // Accept the connection request which creates a connection socket
+            connectionSocket = accept(listenSocket, (struct sockaddr *)&clientAddress, &sizeOfClientInfo); 
+            if (connectionSocket < 0 && errno == EINTR)     // interrupted by a signal, check if asked to stop
+                continue;
+            if (connectionSocket < 0)
+                error("ERROR on accept");
+
+            childPid = fork();                    // Fork a new child process to handle encryption request
+            switch(childPid)                      // switch statements for error / child / and parent process instructions
+            {                     
+            // for errors
+            case -1:
+                perror("fork()\n");
+                
+            // for child processes - handles encryption requests and sends back ciphertext
+            case 0:
+                signal(SIGTERM, SIG_DFL);                                       // stop handling is only for the accepting process
+                signal(SIGUSR1, SIG_IGN);
+                close(listenSocket);
+                serveForkRequest(connectionSocket, clientAddress.sin_addr.s_addr, limiter, keyIndex, sched, packets,
+                                 spool, plaintext, key, ciphertext);
+                releaseSlot(sched, getpid());
                 exit(0);
 
             // for parent process - goes back to listening for encryption requests
@@ -256,6 +3111,7 @@ int main(int argc, char *argv[])
         // check for terminated processes and update the # of active connections
         while((childPid = waitpid(-1, &childStatus, WNOHANG)) > 0)
         {
+            releaseSlot(sched, childPid);                // frees the slot of requests that exited early
             activeConnections--;
         }
     }
@@ -5,6 +5,20 @@
 *  Assignment #5: One-Time Pads - Keygen
 *  Description:  Program for generating random keys of a specified length.
 *
+*                Can also be run as a key pool daemon (-d) which keeps a ring buffer of random key chars topped up
+*                in the background, in memory or in an mmapped file (-f), and hands out exact length keys over a
+*                local unix socket.  Every char in the pool is handed out exactly once.  Keys are taken from a
+*                running pool with -p, which prints them just like a normal keygen run.
+*
+*                With -b a key for the binary pad is generated instead: raw random bytes from /dev/urandom,
+*                written out as is without a trailing newline.
+*
+*                With -S seed keys are generated by a Philox4x32-10 counter based generator instead of rand(), so
+*                the same seed always gives the same output.  Every output position has its own counter, so any
+*                slice of the stream can be generated on its own (-O offset) and the work is split across threads
+*                (-t).  With -c the seeded stream is a plaintext corpus (A-Z and SPACE at English like
+*                frequencies) rather than a key.
+*
 */
 
 
@@ -14,14 +28,80 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 // Declare Global Resources 
 int MAX_RANGE = 27;                             // max range of integers to represent A-Z and SPACE
+static const long DEFAULT_POOL_SIZE = 16777216; // default number of chars held in the key pool
+static const int LOW_WATERMARK_PERCENT = 25;    // pool is refilled once it drops below this percent full
+static const int POOL_CHUNK_SIZE = 65536;       // maximum number of chars handed out per pool lock
+static const int BINARY_CHUNK_SIZE = 65536;     // bytes of binary key copied per read / write
+static const long SEEDED_WINDOW_SIZE = 67108864;// chars generated by the seeded threads per write
+#define MAX_SEEDED_THREADS 64                   // maximum number of threads generating a seeded stream
+
+// Streams a seed can generate, each from its own counter space so they are independent of each other
+enum seededStream { STREAM_KEY, STREAM_BINARY, STREAM_CORPUS };
+
+// Slice of a seeded stream generated by one thread
+struct seededJob
+{
+    uint64_t seed;
+    enum seededStream stream;
+    const char *corpusTable;                    // maps a scaled random value to a corpus char
+    long offset;                                // stream position of the first char
+    long len;
+    char *out;
+};
+
+// Relative frequencies of A-Z then SPACE in the plaintext corpus, per 1000 chars of English text
+static const int CORPUS_WEIGHTS[27] = { 82, 15, 28, 43, 127, 22, 20, 61, 70, 2, 8, 40, 24, 67, 75, 19, 1, 60, 63,
+                                        91, 28, 10, 24, 2, 20, 1, 220 };
+#define CORPUS_WEIGHT_TOTAL 1223                // sum of CORPUS_WEIGHTS
+
+// Header kept at the start of the pool so an mmapped pool file resumes where it left off
+struct poolHeader
+{
+    long size;                                  // number of chars the ring can hold
+    long head;                                  // ring position of the next char to hand out
+    long count;                                 // number of chars ready to hand out
+};
+
+// Key pool shared between the refill thread and client threads
+struct keyPool
+{
+    struct poolHeader *header;                  // ring positions, lives in the pool mapping
+    char *ring;                                 // ring buffer of key chars
+    long lowWatermark;                          // refill starts once count drops below this
+    long refills;                               // metrics: number of low watermark refills
+    long stalls;                                // metrics: number of times a client waited on an empty pool
+    long charsServed;                           // metrics: total chars handed out
+    pthread_mutex_t lock;
+    pthread_cond_t needsRefill;                 // signalled when count drops below the low watermark
+    pthread_cond_t refilled;                    // signalled when new chars are added
+};
+
+struct poolClient
+{
+    struct keyPool *pool;
+    int socketFD;
+};
+
+// Error function used for reporting issues
+void error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
 
 // Converts integers between 0-26 to chars for A-Z or SPACE
 int itoc(int i)
@@ -37,18 +117,458 @@ int itoc(int i)
     return i;
 }
 
+// Set up a unix socket address struct for the key pool
+void setupAddressStruct(struct sockaddr_un *address, char *socketPath)
+{
+    memset((char*) address, '\0', sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strncpy(address->sun_path, socketPath, sizeof(address->sun_path) - 1);
+}
+
+// Maps the pool ring, backed by poolFile if given (resuming its positions) or anonymous memory otherwise
+void mapPool(struct keyPool *pool, long poolSize, char *poolFile)
+{
+    size_t mapSize = sizeof(struct poolHeader) + poolSize;
+    int fileFD = -1;
+    int resume = 0;
+    if (poolFile != NULL)
+    {
+        fileFD = open(poolFile, O_RDWR | O_CREAT, 0600);
+        if (fileFD < 0)
+            error("KEYGEN: ERROR opening pool file");
+        struct stat fileInfo;
+        fstat(fileFD, &fileInfo);
+        resume = fileInfo.st_size == mapSize;   // existing pool of the same size picks up where it left off
+        if (ftruncate(fileFD, mapSize) < 0)
+            error("KEYGEN: ERROR sizing pool file");
+    }
+
+    void *mapping = mmap(NULL, mapSize, PROT_READ | PROT_WRITE,
+                         fileFD < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED, fileFD, 0);
+    if (mapping == MAP_FAILED)
+        error("KEYGEN: ERROR mapping pool");
+    if (fileFD >= 0)
+        close(fileFD);
+
+    pool->header = mapping;
+    pool->ring = (char *) mapping + sizeof(struct poolHeader);
+    if (!resume || pool->header->size != poolSize || pool->header->count > poolSize)
+    {
+        pool->header->size = poolSize;
+        pool->header->head = 0;
+        pool->header->count = 0;
+    }
+    pool->lowWatermark = poolSize * LOW_WATERMARK_PERCENT / 100;
+    pool->refills = pool->stalls = pool->charsServed = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->needsRefill, NULL);
+    pthread_cond_init(&pool->refilled, NULL);
+}
+
+// Background thread which tops the pool back up to full whenever it drops below the low watermark
+void *refillPool(void *arg)
+{
+    struct keyPool *pool = arg;
+    struct poolHeader *header = pool->header;
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (header->count >= pool->lowWatermark)
+        {
+            pthread_cond_wait(&pool->needsRefill, &pool->lock);
+        }
+        pool->refills++;
+
+        // fill the free part of the ring one chunk at a time so clients can take chars as they are made
+        while (header->count < header->size)
+        {
+            long tail = (header->head + header->count) % header->size;
+            long len = header->size - header->count;
+            if (len > header->size - tail)      // stop at the end of the ring
+                len = header->size - tail;
+            if (len > POOL_CHUNK_SIZE)
+                len = POOL_CHUNK_SIZE;
+            pthread_mutex_unlock(&pool->lock);  // only this thread writes past the tail
+
+            for (long i = 0; i < len; i++)
+            {
+                pool->ring[tail + i] = (char) itoc(rand() % MAX_RANGE);
+            }
+
+            pthread_mutex_lock(&pool->lock);
+            header->count += len;
+            pthread_cond_broadcast(&pool->refilled);
+        }
+    }
+    return NULL;
+}
+
+// Takes upto len chars out of the pool into buffer, waiting for a refill if it is empty. Returns chars taken
+long takeFromPool(struct keyPool *pool, char *buffer, long len)
+{
+    struct poolHeader *header = pool->header;
+    pthread_mutex_lock(&pool->lock);
+    if (header->count == 0)
+    {
+        pool->stalls++;
+        while (header->count == 0)
+        {
+            pthread_cond_signal(&pool->needsRefill);
+            pthread_cond_wait(&pool->refilled, &pool->lock);
+        }
+    }
+    if (len > header->count)
+        len = header->count;
+    if (len > header->size - header->head)      // stop at the end of the ring
+        len = header->size - header->head;
+
+    // chars are copied out before the lock is released so each one is handed out exactly once
+    memcpy(buffer, pool->ring + header->head, len);
+    header->head = (header->head + len) % header->size;
+    header->count -= len;
+    pool->charsServed += len;
+    if (header->count < pool->lowWatermark)
+    {
+        pthread_cond_signal(&pool->needsRefill);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return len;
+}
+
+// Handles a single pool client - reads the requested key length (or "stats") and sends back that many chars
+void *servePoolClient(void *arg)
+{
+    struct poolClient *client = arg;
+    struct keyPool *pool = client->pool;
+    char request[64];
+    char *buffer = malloc(POOL_CHUNK_SIZE);
+
+    memset(request, '\0', sizeof(request));
+    int charsRead = recv(client->socketFD, request, sizeof(request) - 1, 0);
+    if (charsRead > 0 && strncmp(request, "stats", 5) == 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        int len = snprintf(buffer, POOL_CHUNK_SIZE, "size %ld\navailable %ld\nlow_watermark %ld\n"
+                           "refills %ld\nstalls %ld\nserved %ld\n", pool->header->size, pool->header->count,
+                           pool->lowWatermark, pool->refills, pool->stalls, pool->charsServed);
+        pthread_mutex_unlock(&pool->lock);
+        send(client->socketFD, buffer, len, MSG_NOSIGNAL);
+    }
+    else if (charsRead > 0)
+    {
+        long remaining = strtol(request, NULL, 10);
+        while (remaining > 0)
+        {
+            long len = takeFromPool(pool, buffer, remaining < POOL_CHUNK_SIZE ? remaining : POOL_CHUNK_SIZE);
+            long sent = 0;
+            while (sent < len)
+            {
+                long charsWritten = send(client->socketFD, buffer + sent, len - sent, MSG_NOSIGNAL);
+                if (charsWritten <= 0)          // client went away, the chars it took are gone for good
+                {
+                    remaining = 0;
+                    break;
+                }
+                sent += charsWritten;
+            }
+            remaining -= len;
+        }
+    }
+
+    close(client->socketFD);
+    free(buffer);
+    free(client);
+    return NULL;
+}
+
+// Runs the key pool daemon on socketPath, never returns
+void runPoolDaemon(char *socketPath, long poolSize, char *poolFile)
+{
+    struct keyPool pool;
+    struct sockaddr_un address;
+    pthread_t thread;
+
+    mapPool(&pool, poolSize, poolFile);
+    if (pthread_create(&thread, NULL, refillPool, &pool) != 0)
+        error("KEYGEN: ERROR starting refill thread");
+    pthread_cond_signal(&pool.needsRefill);     // fill the pool up before the first request comes in
+
+    // Create, bind and listen on the pool socket
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket < 0)
+        error("KEYGEN: ERROR opening socket");
+    setupAddressStruct(&address, socketPath);
+    unlink(socketPath);                         // clear out socket left behind by a previous run
+    if (bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) < 0)
+        error("KEYGEN: ERROR on binding");
+    listen(listenSocket, 16);
+
+    // Serve each client on its own thread
+    while (1)
+    {
+        int connectionSocket = accept(listenSocket, NULL, NULL);
+        if (connectionSocket < 0)
+            error("KEYGEN: ERROR on accept");
+        struct poolClient *client = malloc(sizeof(*client));
+        client->pool = &pool;
+        client->socketFD = connectionSocket;
+        if (pthread_create(&thread, NULL, servePoolClient, client) != 0)
+            error("KEYGEN: ERROR starting client thread");
+        pthread_detach(thread);
+    }
+}
+
+// Writes a binary pad key of length random bytes to stdout
+void writeBinaryKey(long length)
+{
+    char buffer[BINARY_CHUNK_SIZE];
+    int randomFD = open("/dev/urandom", O_RDONLY);
+    if (randomFD < 0)
+        error("ERROR opening /dev/urandom");
+    while (length > 0)
+    {
+        ssize_t chunkLen = read(randomFD, buffer, length < BINARY_CHUNK_SIZE ? length : BINARY_CHUNK_SIZE);
+        if (chunkLen <= 0)
+            error("ERROR reading /dev/urandom");
+        if (fwrite(buffer, 1, chunkLen, stdout) != chunkLen)
+            error("ERROR writing key");
+        length -= chunkLen;
+    }
+    close(randomFD);
+}
+
+/*-- Seeded Counter Mode --*/
+// Philox4x32-10 (Salmon et al, "Parallel Random Numbers: As Easy as 1, 2, 3") turns a 128 bit counter and 64 bit
+// key into 128 random bits.  The seed is the key and the stream position is the counter, so jumping anywhere in the
+// stream is O(1) and threads never share generator state.
+
+// Runs the 10 Philox rounds over counter with the given key, leaving the random output in counter
+void philox4x32(uint32_t counter[4], uint64_t seed)
+{
+    uint32_t key0 = (uint32_t) seed, key1 = (uint32_t) (seed >> 32);
+    for (int round = 0; round < 10; round++)
+    {
+        uint64_t product0 = (uint64_t) 0xD2511F53 * counter[0];
+        uint64_t product1 = (uint64_t) 0xCD9E8D57 * counter[2];
+        uint32_t next[4] = { (uint32_t) (product1 >> 32) ^ counter[1] ^ key0, (uint32_t) product1,
+                             (uint32_t) (product0 >> 32) ^ counter[3] ^ key1, (uint32_t) product0 };
+        memcpy(counter, next, sizeof(next));
+        key0 += 0x9E3779B9;                     // Weyl sequence key schedule
+        key1 += 0xBB67AE85;
+    }
+}
+
+// Generates job->len chars of a seeded stream starting at job->offset.  Text streams take one 32 bit word per char,
+// binary streams use all 16 bytes of each block
+void *generateSeeded(void *arg)
+{
+    struct seededJob *job = arg;
+    int charsPerBlock = job->stream == STREAM_BINARY ? 16 : 4;
+    for (long i = 0; i < job->len; )
+    {
+        long position = job->offset + i;
+        uint64_t block = position / charsPerBlock;
+        uint32_t counter[4] = { (uint32_t) block, (uint32_t) (block >> 32), job->stream, 0 };
+        philox4x32(counter, job->seed);
+
+        // emit the block from the lane position lands on, so slices can start mid block
+        for (int lane = position % charsPerBlock; lane < charsPerBlock && i < job->len; lane++, i++)
+        {
+            if (job->stream == STREAM_BINARY)
+            {
+                job->out[i] = (char) (counter[lane / 4] >> (8 * (lane % 4)));
+            }
+            else if (job->stream == STREAM_CORPUS)
+            {
+                job->out[i] = job->corpusTable[((uint64_t) counter[lane] * CORPUS_WEIGHT_TOTAL) >> 32];
+            }
+            else
+            {
+                job->out[i] = (char) itoc(((uint64_t) counter[lane] * MAX_RANGE) >> 32);  // multiply-shift to 0-26
+            }
+        }
+    }
+    return NULL;
+}
+
+// Writes length chars of the seeded stream from offset to stdout, generated in windows split across numThreads
+void writeSeeded(uint64_t seed, enum seededStream stream, long offset, long length, int numThreads)
+{
+    pthread_t threads[MAX_SEEDED_THREADS];
+    struct seededJob jobs[MAX_SEEDED_THREADS];
+    char corpusTable[CORPUS_WEIGHT_TOTAL];
+    long windowSize = length < SEEDED_WINDOW_SIZE ? length : SEEDED_WINDOW_SIZE;
+    char *window = malloc(windowSize > 0 ? windowSize : 1);
+    if (window == NULL)
+        error("KEYGEN: ERROR allocating seeded window");
+
+    // lookup table from a value scaled to the weight total to its corpus char
+    for (int c = 0, filled = 0; c < 27; c++)
+    {
+        memset(corpusTable + filled, itoc(c), CORPUS_WEIGHTS[c]);
+        filled += CORPUS_WEIGHTS[c];
+    }
+
+    for (long done = 0; done < length; )
+    {
+        long len = length - done < windowSize ? length - done : windowSize;
+        long sliceLen = (len + numThreads - 1) / numThreads;
+        int started = 0;
+        for (int t = 0; t < numThreads && t * sliceLen < len; t++, started++)
+        {
+            struct seededJob *job = &jobs[t];
+            job->seed = seed;
+            job->stream = stream;
+            job->corpusTable = corpusTable;
+            job->offset = offset + done + t * sliceLen;
+            job->len = len - t * sliceLen < sliceLen ? len - t * sliceLen : sliceLen;
+            job->out = window + t * sliceLen;
+            if (pthread_create(&threads[t], NULL, generateSeeded, job) != 0)
+                error("KEYGEN: ERROR starting generator thread");
+        }
+        for (int t = 0; t < started; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+        if (fwrite(window, 1, len, stdout) != len)
+            error("KEYGEN: ERROR writing key");
+        done += len;
+    }
+    if (stream != STREAM_BINARY)
+    {
+        printf("\n");                          // text output ends in a new line just like a normal keygen run
+    }
+    free(window);
+}
+
+// Takes a key of the given length (or "stats") from the pool daemon on socketPath and prints it to stdout
+void fetchPoolKey(char *socketPath, char *request)
+{
+    struct sockaddr_un address;
+    char buffer[POOL_CHUNK_SIZE];
+    long charsRead, total = 0;
+    long length = strtol(request, NULL, 10);
+    int isStats = strcmp(request, "stats") == 0;
+
+    int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFD < 0)
+        error("KEYGEN: ERROR opening socket");
+    setupAddressStruct(&address, socketPath);
+    if (connect(socketFD, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "Error: could not contact key pool at %s\n", socketPath);
+        exit(2);
+    }
+    if (send(socketFD, request, strlen(request), 0) < 0)
+        error("KEYGEN: ERROR writing to socket");
+
+    // copy the key straight through to stdout
+    while ((charsRead = recv(socketFD, buffer, sizeof(buffer), 0)) > 0)
+    {
+        fwrite(buffer, 1, charsRead, stdout);
+        total += charsRead;
+    }
+    close(socketFD);
+
+    if (!isStats)
+    {
+        if (total < length)
+        {
+            fprintf(stderr, "Error: key pool only returned %ld of %ld chars\n", total, length);
+            exit(1);
+        }
+        printf("\n");                          // keys end in a new line just like a normal keygen run
+    }
+}
+
 int main (int argc, char *argv[])
 {
+    int option, binaryKey = 0, seeded = 0, corpus = 0, numThreads = 0;
+    uint64_t seed = 0;
+    long offset = 0;
+    char *daemonSocket = NULL;
+    char *poolSocket = NULL;
+    char *poolFile = NULL;
+    long poolSize = DEFAULT_POOL_SIZE;
+
+    // Check options - daemon mode, pool client mode or plain key generation
+    while ((option = getopt(argc, argv, "d:p:s:f:bS:O:t:c")) != -1)
+    {
+        switch (option)
+        {
+        case 'd': daemonSocket = optarg; break;
+        case 'p': poolSocket = optarg; break;
+        case 's': poolSize = strtol(optarg, NULL, 10); break;
+        case 'f': poolFile = optarg; break;
+        case 'b': binaryKey = 1; break;
+        case 'S': seeded = 1; seed = strtoull(optarg, NULL, 0); break;
+        case 'O': offset = strtol(optarg, NULL, 10); break;
+        case 't': numThreads = atoi(optarg); break;
+        case 'c': corpus = 1; break;
+        default:
+            fprintf(stderr, "USAGE: %s [-b] keylength\n"
+                            "       %s -S seed [-b|-c] [-O offset] [-t threads] length\n"
+                            "       %s -d socket [-s poolsize] [-f poolfile]\n"
+                            "       %s -p socket keylength|stats\n", argv[0], argv[0], argv[0], argv[0]);
+            exit(0);
+        }
+    }
+
+    srand(time(0));                             // initialize seed for random
+    if (daemonSocket != NULL)
+    {
+        if (poolSize <= 0)
+        {
+            fprintf(stderr, "Error: invalid pool size\n");
+            exit(1);
+        }
+        runPoolDaemon(daemonSocket, poolSize, poolFile);
+    }
+
     // Check usage & args
-    if (argc < 2) { 
+    if (optind >= argc) { 
         fprintf(stderr, "USAGE: %s keylength\n", argv[0]); 
         exit(0); 
     }
 
+    if (poolSocket != NULL)
+    {
+        fetchPoolKey(poolSocket, argv[optind]);
+        return(0);
+    }
+
+    if (corpus && !seeded)                      // corpus without a seed still needs the counter generator
+    {
+        seeded = 1;
+        seed = time(0);
+    }
+    if (seeded)                                 // reproducible stream from the seed, starting at offset
+    {
+        long length = strtol(argv[optind], NULL, 10);
+        if (numThreads <= 0)
+            numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (numThreads > MAX_SEEDED_THREADS)
+            numThreads = MAX_SEEDED_THREADS;
+        if (numThreads <= 0)
+            numThreads = 1;
+        if (length < 0 || offset < 0)
+        {
+            fprintf(stderr, "Error: invalid length or offset\n");
+            exit(1);
+        }
+        writeSeeded(seed, corpus ? STREAM_CORPUS : binaryKey ? STREAM_BINARY : STREAM_KEY, offset, length, numThreads);
+        return(0);
+    }
+
+    if (binaryKey)                              // binary pad keys are raw bytes rather than A-Z and SPACE
+    {
+        writeBinaryKey(strtol(argv[optind], NULL, 10));
+        return(0);
+    }
+
     int i;
-    int length = strtol(argv[1], NULL, 10);     // convert str to long int type for console keylength input
+    int length = strtol(argv[optind], NULL, 10);    // convert str to long int type for console keylength input
     char buffer[length+1];
-    srand(time(0));                             // initialize seed for random
 
     /* Print random letters given a randomly generated 0-27 num */
     for(i = 0 ; i < length ; i++ ) 
@@ -0,0 +1,335 @@
+/*
+*  Name : Terence Tang
+*  Course : CS344 - Operating Systems
+*  Assignment #5: One-Time Pads - Load Balancing Proxy
+*  Description:  Proxy which accepts enc_client / dec_client connections on a single port and spreads them across a
+*                pool of localhost enc_server or dec_server backends.  Each request is sent to the healthy backend
+*                with the least outstanding requests.  Backends are health checked in the background and taken out
+*                of rotation when they stop accepting connections.  A request whose backend has gone down since
+*                the last health check is retried on the other healthy backends before the client is dropped.
+*
+*                Each client connection is handled by a child process which connects to the chosen backend and
+*                forwards data in both directions with splice() so payloads never pass through userspace.
+*
+*                Note: the otp servers close the connection after every reply, so a backend connection can only
+*                serve the one request it was opened for.
+*
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+// Declare Global Resources
+#define MAX_BACKENDS 16                              // maximum number of backend servers in the pool
+#define MAX_CHILDREN 256                             // maximum number of in flight proxied requests
+static const int SPLICE_CHUNK_SIZE = 65536;          // maximum size of data moved per splice call
+static const int HEALTH_CHECK_INTERVAL = 2;          // seconds between backend health checks
+static const int BACKEND_DOWN_STATUS = 3;            // child exit status used to report an unreachable backend
+
+struct backend
+{
+    int port;                                        // localhost port the backend listens on
+    int healthy;                                     // 1 if backend passed its last health check
+    int outstanding;                                 // number of requests currently proxied to backend
+};
+
+struct proxyChild
+{
+    pid_t pid;                                       // child process handling the request
+    int backendIndex;                                // backend the request was sent to
+};
+
+// Error function used for reporting issues
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+// Set up the address struct for a localhost socket
+void setupAddressStruct(struct sockaddr_in* address, int portNumber)
+{
+    memset((char*) address, '\0', sizeof(*address));                // Clear out the address struct
+    address->sin_family = AF_INET;                                  // The address should be network capable
+    address->sin_port = htons(portNumber);                          // Store the port number
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);              // Backends all run on this host
+}
+
+// Opens a connection to the backend on portNumber, returns the socket or -1 if it could not be reached
+int connectBackend(int portNumber)
+{
+    struct sockaddr_in backendAddress;
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0)
+    {
+        return -1;
+    }
+    setupAddressStruct(&backendAddress, portNumber);
+    if (connect(socketFD, (struct sockaddr *)&backendAddress, sizeof(backendAddress)) < 0)
+    {
+        close(socketFD);
+        return -1;
+    }
+    return socketFD;
+}
+
+// Checks each backend accepts connections and updates its health, logging any changes
+void checkBackends(struct backend *backends, int numBackends)
+{
+    for (int i = 0; i < numBackends; i++)
+    {
+        int socketFD = connectBackend(backends[i].port);
+        int healthy = socketFD >= 0;
+        if (socketFD >= 0)
+        {
+            close(socketFD);                                        // servers drop requests that hang up
+        }
+        if (healthy != backends[i].healthy)
+        {
+            fprintf(stderr, "PROXY: backend on port %d is %s\n", backends[i].port, healthy ? "up" : "down");
+        }
+        backends[i].healthy = healthy;
+    }
+}
+
+// Picks the healthy backend with the least outstanding requests, rotating between ties. Returns -1 if none are up
+int pickBackend(struct backend *backends, int numBackends, int *lastPicked)
+{
+    int best = -1;
+    for (int n = 1; n <= numBackends; n++)
+    {
+        int i = (*lastPicked + n) % numBackends;                    // start after the last pick to rotate ties
+        if (backends[i].healthy && (best < 0 || backends[i].outstanding < backends[best].outstanding))
+        {
+            best = i;
+        }
+    }
+    if (best >= 0)
+    {
+        *lastPicked = best;
+    }
+    return best;
+}
+
+// Moves whatever data is available on fromFD to toFD through the pipe, returns 0 once fromFD reaches EOF
+int spliceData(int fromFD, int toFD, int *pipeFDs)
+{
+    ssize_t charsIn = splice(fromFD, NULL, pipeFDs[1], NULL, SPLICE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (charsIn < 0)
+    {
+        if (errno == EAGAIN)                                        // spurious wakeup, nothing to move yet
+        {
+            return 1;
+        }
+        error("PROXY: ERROR splicing from socket");
+    }
+    if (charsIn == 0)                                               // other side has hung up
+    {
+        return 0;
+    }
+
+    // drain everything that was moved into the pipe out to the other socket
+    while (charsIn > 0)
+    {
+        ssize_t charsOut = splice(pipeFDs[0], NULL, toFD, NULL, charsIn, SPLICE_F_MOVE);
+        if (charsOut < 0)
+        {
+            error("PROXY: ERROR splicing to socket");
+        }
+        charsIn -= charsOut;
+    }
+    return 1;
+}
+
+// Forwards a client connection to the chosen backend until both sides are done.  If the chosen backend cannot be
+// reached the other healthy backends are tried in turn, and the client is only dropped when none accept
+void proxyConnection(int clientSocket, struct backend *backends, int numBackends, int chosen)
+{
+    int toBackend[2], toClient[2];
+    int backendSocket = connectBackend(backends[chosen].port);
+    int chosenDown = backendSocket < 0;
+    for (int n = 1; n < numBackends && backendSocket < 0; n++)
+    {
+        int i = (chosen + n) % numBackends;
+        if (backends[i].healthy)
+            backendSocket = connectBackend(backends[i].port);
+    }
+    if (backendSocket < 0)
+    {
+        fprintf(stderr, "PROXY: no backend accepted request\n");
+        close(clientSocket);
+        exit(BACKEND_DOWN_STATUS);                                  // lets parent take backend out of rotation
+    }
+    if (pipe(toBackend) < 0 || pipe(toClient) < 0)
+    {
+        error("PROXY: ERROR creating pipes");
+    }
+
+    // poll both sockets and forward data until the backend has sent its full reply and closed
+    struct pollfd fds[2] = {{clientSocket, POLLIN, 0}, {backendSocket, POLLIN, 0}};
+    while (fds[1].fd >= 0)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            error("PROXY: ERROR polling sockets");
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            if (spliceData(clientSocket, backendSocket, toBackend) == 0)
+            {
+                shutdown(backendSocket, SHUT_WR);                   // pass client hang up along to backend
+                fds[0].fd = -1;
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            if (spliceData(backendSocket, clientSocket, toClient) == 0)
+            {
+                fds[1].fd = -1;
+            }
+        }
+    }
+
+    close(backendSocket);
+    close(clientSocket);
+    exit(chosenDown ? BACKEND_DOWN_STATUS : 0);                     // chosen backend is still down if another served
+}
+
+int main(int argc, char *argv[])
+{
+    int connectionSocket, childStatus, numBackends, numChildren, lastPicked;
+    struct backend backends[MAX_BACKENDS];
+    struct proxyChild children[MAX_CHILDREN];
+    struct sockaddr_in serverAddress, clientAddress;
+    socklen_t sizeOfClientInfo = sizeof(clientAddress);
+    pid_t childPid;
+
+    /*-- Check usage & args --*/
+    if (argc < 3)
+    {
+        fprintf(stderr,"USAGE: %s port backendport [backendport...]\n", argv[0]);
+        exit(1);
+    }
+
+    /*-- Set Up Backend Pool --*/
+    numBackends = 0;
+    for (int i = 2; i < argc && numBackends < MAX_BACKENDS; i++)
+    {
+        backends[numBackends].port = atoi(argv[i]);
+        backends[numBackends].healthy = 0;
+        backends[numBackends].outstanding = 0;
+        numBackends++;
+    }
+    checkBackends(backends, numBackends);
+    time_t lastCheck = time(NULL);
+    lastPicked = numBackends - 1;
+    numChildren = 0;
+
+    /*-- Create and Bind Socket & Start Listening For Connections --*/
+    // Create the socket
+    int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket < 0)
+        error("ERROR opening socket");
+
+    // Set up the address struct for the proxy socket
+    setupAddressStruct(&serverAddress, atoi(argv[1]));
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+
+    // Bind/Associate the socket to the port
+    if (bind(listenSocket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
+        error("ERROR on binding");
+
+    // Start listening for connetions
+    listen(listenSocket, 64);
+
+    /*-- Accept and Forward Connections --*/
+    struct pollfd listenFD = {listenSocket, POLLIN, 0};
+    while(1){
+        // wake up at least once a second so health checks keep running while idle
+        int ready = poll(&listenFD, 1, 1000);
+        if (ready < 0 && errno != EINTR)
+            error("ERROR on poll");
+
+        if (ready > 0 && numChildren < MAX_CHILDREN)
+        {
+            // Accept the connection request which creates a connection socket
+            connectionSocket = accept(listenSocket, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
+            if (connectionSocket < 0)
+                error("ERROR on accept");
+
+            int backendIndex = pickBackend(backends, numBackends, &lastPicked);
+            if (backendIndex < 0)                                   // no healthy backends, drop the request
+            {
+                fprintf(stderr, "PROXY: no healthy backends for request\n");
+                close(connectionSocket);
+                continue;
+            }
+
+            childPid = fork();                    // Fork a new child process to forward the request
+            switch(childPid)
+            {
+            // for errors
+            case -1:
+                perror("fork()\n");
+                close(connectionSocket);
+                break;
+
+            // for child processes - forwards request to backend
+            case 0:
+                close(listenSocket);
+                proxyConnection(connectionSocket, backends, numBackends, backendIndex);
+
+            // for parent process - track outstanding request and go back to listening
+            default:
+                close(connectionSocket);
+                backends[backendIndex].outstanding++;
+                children[numChildren].pid = childPid;
+                children[numChildren].backendIndex = backendIndex;
+                numChildren++;
+            }
+        }
+
+        // check for terminated processes and release their backend's outstanding request, blocking for one while
+        // at capacity, as the waiting connection keeps the listener readable and poll() would return straight away
+        while((childPid = waitpid(-1, &childStatus, numChildren >= MAX_CHILDREN ? 0 : WNOHANG)) > 0)
+        {
+            for (int i = 0; i < numChildren; i++)
+            {
+                if (children[i].pid != childPid)
+                    continue;
+                struct backend *b = &backends[children[i].backendIndex];
+                b->outstanding--;
+                if (WIFEXITED(childStatus) && WEXITSTATUS(childStatus) == BACKEND_DOWN_STATUS && b->healthy)
+                {
+                    fprintf(stderr, "PROXY: backend on port %d is down\n", b->port);
+                    b->healthy = 0;
+                }
+                children[i] = children[--numChildren];
+                break;
+            }
+        }
+
+        // periodically re-check backend health
+        if (time(NULL) - lastCheck >= HEALTH_CHECK_INTERVAL)
+        {
+            checkBackends(backends, numBackends);
+            lastCheck = time(NULL);
+        }
+    }
+
+    // Close the listening socket and exit program
+    close(listenSocket);
+    return 0;
+}
@@ -0,0 +1,438 @@
+/*
+*  Name : Terence Tang
+*  Course : CS344 - Operating Systems
+*  Assignment #5: One-Time Pads - Traffic Replay
+*  Description:  Plays a capture file written by enc_server / dec_server "-c" back against localhost servers, to
+*                benchmark a build with the shape of real traffic.  Each captured request is sent again at the same
+*                offset from the start of the capture (or sooner with -s speed), with the same operation, pad and
+*                length, but with made up data: random letters and spaces for the text pad or random bytes for the
+*                binary pad.  Data is seeded by the request's position in the capture, so every replay of a
+*                capture sends exactly the same bytes.
+*
+*                Once every request is done latency percentiles per operation are printed next to those in the
+*                capture, along with how far the replay fell behind schedule.  -o saves the replay as a capture
+*                file of its own, and "-x fileA fileB" compares two capture files, so replays of one capture
+*                against two builds can be compared like for like.
+*
+*                Note: captured times are measured inside the server while replayed times are measured by the
+*                client and also include connecting, so compare replays with replays.  Async jobs and requests
+*                which hung up before sending their length are not replayed.
+*
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+// Declare Global Resources
+#define MAX_CHILDREN 512                             // maximum number of replayed requests in flight
+#define MAX_REPLAY_SIZE (1 << 20)                    // longest request replayed, longer ones are cut down to this
+static const int TRANSMISSION_SIZE = 65536;          // maximum size of data sent per send call
+static const long START_DELAY_US = 100000;           // head start given to forking before the first request is due
+static const char *OPS[] = {"enc", "dec", "rekey"};  // operations, in the order they are reported
+
+enum replayStatus { REPLAY_FAILED, REPLAY_REPLY, REPLAY_THROTTLED, REPLAY_DENIED, REPLAY_REUSED };
+static const char *STATUS_NAMES[] = {"closed", "reply", "throttled", "denied", "reused"};
+
+struct request
+{
+    long startUs;                                    // wall clock time the request arrived, in microseconds
+    char op[8];                                      // enc, dec or rekey
+    int binary;                                      // 1 if the request used the binary pad
+    int length;                                      // data length
+    long totalUs;                                    // time taken to serve it
+    char result[16];                                 // how it ended - reply, throttled, denied, reused or closed
+};
+
+struct replayResult
+{
+    long latencyUs;                                  // connect to last byte of the reply, filled in by the child
+    long lateUs;                                     // how long after its scheduled time the request was sent
+    int status;                                      // replayStatus, REPLAY_FAILED until the child finishes
+};
+
+// Error function used for reporting issues
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+// Set up the address struct for a localhost socket
+void setupAddressStruct(struct sockaddr_in* address, int portNumber)
+{
+    memset((char*) address, '\0', sizeof(*address));                // Clear out the address struct
+    address->sin_family = AF_INET;                                  // The address should be network capable
+    address->sin_port = htons(portNumber);                          // Store the port number
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);              // Servers all run on this host
+}
+
+// Returns the current time of clock in microseconds
+long clockUs(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+// Orders requests by arrival time
+int compareStart(const void *a, const void *b)
+{
+    long startA = ((const struct request *) a)->startUs, startB = ((const struct request *) b)->startUs;
+    return (startA > startB) - (startA < startB);
+}
+
+// Orders times from shortest to longest
+int compareLong(const void *a, const void *b)
+{
+    long valueA = *(const long *) a, valueB = *(const long *) b;
+    return (valueA > valueB) - (valueA < valueB);
+}
+
+// Reads every request line of a capture file, sorted by arrival time.  Returns the number of requests read
+int readCapture(char *fileName, struct request **requests)
+{
+    char line[256];
+    int count = 0, capacity = 1024;
+    FILE *file = fopen(fileName, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: could not open capture file %s\n", fileName);
+        exit(1);
+    }
+    *requests = malloc(capacity * sizeof(struct request));
+    if (*requests == NULL)
+        error("ERROR allocating requests");
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        struct request *r = &(*requests)[count];
+        if (line[0] == '#')                                         // column header
+            continue;
+        if (sscanf(line, "%ld %7s %d %d %*s %*s %*s %ld %15s", &r->startUs, r->op, &r->binary, &r->length,
+                   &r->totalUs, r->result) != 6)
+        {
+            fprintf(stderr, "REPLAY: skipping malformed capture line: %s", line);
+            continue;
+        }
+        if (++count == capacity)
+        {
+            capacity *= 2;
+            *requests = realloc(*requests, capacity * sizeof(struct request));
+            if (*requests == NULL)
+                error("ERROR allocating requests");
+        }
+    }
+    fclose(file);
+    qsort(*requests, count, sizeof(struct request), compareStart);
+    return count;
+}
+
+// Returns 1 if the captured request can be replayed
+int isReplayable(struct request *r)
+{
+    return r->length > 0 && strcmp(r->result, "job") != 0;
+}
+
+// Fills buffer with len chars of made up data for the pad, from the generator state in seed
+void fillData(char *buffer, int len, int binary, unsigned long *seed)
+{
+    for (int i = 0; i < len; i++)
+    {
+        *seed ^= *seed << 13;                                       // xorshift, so data depends only on the seed
+        *seed ^= *seed >> 7;
+        *seed ^= *seed << 17;
+        buffer[i] = binary ? (char) (*seed >> 24) : "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[(*seed >> 24) % 27];
+    }
+}
+
+// Sends all len chars of data, returns 0 if the server hung up
+int sendAll(int socketFD, const char *data, int len)
+{
+    int charsWritten = 0;
+    while (charsWritten < len)
+    {
+        int chunkLen = len - charsWritten < TRANSMISSION_SIZE ? len - charsWritten : TRANSMISSION_SIZE;
+        int charsOut = send(socketFD, data + charsWritten, chunkLen, charsWritten + chunkLen < len ? MSG_MORE : 0);
+        if (charsOut <= 0)
+            return 0;
+        charsWritten += charsOut;
+    }
+    return 1;
+}
+
+// Sends msg and reads the server's answer into buffer, returns 0 if the server hung up
+int exchange(int socketFD, const char *msg, int len, char *buffer, int bufferLen)
+{
+    if (!sendAll(socketFD, msg, len))
+        return 0;
+    memset(buffer, '\0', bufferLen);
+    return recv(socketFD, buffer, bufferLen - 1, 0) > 0;
+}
+
+// Runs one request against the server on portNumber the way enc_client / dec_client would, returns its status
+int replayRequest(struct request *r, int portNumber, unsigned long seed)
+{
+    char buffer[64];
+    int isEnc = strcmp(r->op, "enc") == 0, isRekey = strcmp(r->op, "rekey") == 0;
+    int len = r->length < MAX_REPLAY_SIZE ? r->length : MAX_REPLAY_SIZE;
+    char *data = malloc((size_t) len * 3);
+    if (data == NULL)
+        return REPLAY_FAILED;
+    fillData(data, len * (isRekey ? 3 : 2), r->binary, &seed);      // data, key and any new key back to back
+
+    struct sockaddr_in serverAddress;
+    setupAddressStruct(&serverAddress, portNumber);
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0 || connect(socketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
+        return REPLAY_FAILED;
+    int noDelay = 1;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    // request type, then length - either may be turned away
+    char type[32];
+    snprintf(type, sizeof(type), "%s%s%s", isEnc ? "enc_server" : "dec_server", r->binary ? " binary" : "",
+             isRekey ? " rekey" : "");
+    if (!exchange(socketFD, type, strlen(type), buffer, sizeof(buffer)))
+        return REPLAY_FAILED;
+    if (strcmp(buffer, "denied") == 0)
+        return REPLAY_DENIED;
+    if (strncmp(buffer, "throttled", 9) == 0)
+        return REPLAY_THROTTLED;
+    char lengthMsg[16];
+    if (!exchange(socketFD, lengthMsg, sprintf(lengthMsg, "%d", len), buffer, sizeof(buffer)))
+        return REPLAY_FAILED;
+    if (strncmp(buffer, "throttled", 9) == 0)
+        return REPLAY_THROTTLED;
+
+    // data, key and new key, each acknowledged in turn
+    if (!exchange(socketFD, data, len, buffer, sizeof(buffer)) || strstr(buffer, "Received") == NULL)
+        return REPLAY_FAILED;
+    if (!exchange(socketFD, data + len, len, buffer, sizeof(buffer)))
+        return REPLAY_FAILED;
+    if (strcmp(buffer, "Key Reused") == 0)
+        return REPLAY_REUSED;
+    if (strcmp(buffer, "Key Received") != 0)
+        return REPLAY_FAILED;
+    if (isRekey && !exchange(socketFD, data + 2 * len, len, buffer, sizeof(buffer)))
+        return REPLAY_FAILED;
+    if (isRekey && strcmp(buffer, "Key Reused") == 0)
+        return REPLAY_REUSED;
+    if (isRekey && strcmp(buffer, "New Key Received") != 0)
+        return REPLAY_FAILED;
+
+    // reply is the same length as the data, read it into the data's place
+    if (!sendAll(socketFD, "Waiting for ciphertext..", strlen("Waiting for ciphertext..")))
+        return REPLAY_FAILED;
+    int totalRead = 0;
+    while (totalRead < len)
+    {
+        int charsRead = recv(socketFD, data + totalRead, len - totalRead, 0);
+        if (charsRead <= 0)
+            return REPLAY_FAILED;
+        totalRead += charsRead;
+    }
+    close(socketFD);
+    return REPLAY_REPLY;
+}
+
+// Collects the times of requests for op which got a reply into times, sorted, and returns how many there are
+int collectTimes(struct request *requests, int count, const char *op, long *times)
+{
+    int n = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(requests[i].op, op) == 0 && strcmp(requests[i].result, "reply") == 0)
+            times[n++] = requests[i].totalUs;
+    }
+    qsort(times, n, sizeof(long), compareLong);
+    return n;
+}
+
+// Prints a row of latency percentiles for sorted times
+void printPercentiles(const char *op, const char *source, long *times, int n)
+{
+    if (n == 0)
+        return;
+    printf("%-6s %-10s %8d %10ld %10ld %10ld %10ld\n", op, source, n, times[(n - 1) / 2], times[(n - 1) * 9 / 10],
+           times[(n - 1) * 99 / 100], times[n - 1]);
+}
+
+// Prints latency percentiles per operation for two sets of requests, one above the other
+void printComparison(const char *nameA, struct request *requestsA, int countA, const char *nameB,
+                     struct request *requestsB, int countB)
+{
+    long *times = malloc(sizeof(long) * ((countA > countB ? countA : countB) + 1));
+    if (times == NULL)
+        error("ERROR allocating times");
+    printf("%-6s %-10s %8s %10s %10s %10s %10s\n", "op", "source", "replies", "p50_us", "p90_us", "p99_us", "max_us");
+    for (int i = 0; i < sizeof(OPS) / sizeof(OPS[0]); i++)
+    {
+        printPercentiles(OPS[i], nameA, times, collectTimes(requestsA, countA, OPS[i], times));
+        printPercentiles(OPS[i], nameB, times, collectTimes(requestsB, countB, OPS[i], times));
+    }
+
+    // requests which did not get a reply
+    for (int i = 0; i < 2; i++)
+    {
+        struct request *requests = i == 0 ? requestsA : requestsB;
+        int count = i == 0 ? countA : countB, others = 0;
+        for (int j = 0; j < count; j++)
+            others += strcmp(requests[j].result, "reply") != 0;
+        if (others > 0)
+            printf("%s: %d of %d requests got no reply\n", i == 0 ? nameA : nameB, others, count);
+    }
+    free(times);
+}
+
+// Writes the replayed requests out as a capture file
+void writeReplay(char *fileName, struct request *replayed, int count)
+{
+    FILE *file = fopen(fileName, "w");
+    if (file == NULL)
+        error("ERROR opening output file");
+    fprintf(file, "# start_us op binary length wait_us upload_us reply_us total_us result\n");
+    for (int i = 0; i < count; i++)
+    {
+        struct request *r = &replayed[i];
+        fprintf(file, "%ld %s %d %d -1 -1 -1 %ld %s\n", r->startUs, r->op, r->binary, r->length, r->totalUs,
+                r->result);
+    }
+    fclose(file);
+}
+
+int main(int argc, char *argv[])
+{
+    int option, numRequests, numChildren = 0, compare = 0;
+    double speed = 1.0;
+    char *outputName = NULL;
+    struct request *requests;
+
+    /*-- Check usage & args --*/
+    while ((option = getopt(argc, argv, "s:o:x")) != -1)
+    {
+        switch (option)
+        {
+        case 's':                                                   // replay this many times faster than captured
+            speed = atof(optarg);
+            break;
+        case 'o':                                                   // save the replay as a capture file
+            outputName = optarg;
+            break;
+        case 'x':                                                   // compare two capture files instead
+            compare = 1;
+            break;
+        default:
+            compare = -1;
+        }
+    }
+    if (compare == 1 && argc - optind == 2)
+    {
+        struct request *other;
+        numRequests = readCapture(argv[optind], &requests);
+        int numOther = readCapture(argv[optind + 1], &other);
+        printComparison("A", requests, numRequests, "B", other, numOther);
+        return 0;
+    }
+    if (compare != 0 || argc - optind != 3 || speed <= 0)
+    {
+        fprintf(stderr,"USAGE: %s [-s speed] [-o outfile] capturefile encport decport\n"
+                       "       %s -x capturefile capturefile\n", argv[0], argv[0]);
+        exit(1);
+    }
+    int encPort = atoi(argv[optind + 1]), decPort = atoi(argv[optind + 2]);
+
+    /*-- Pick Out Replayable Requests --*/
+    int numCaptured = readCapture(argv[optind], &requests);
+    numRequests = 0;
+    for (int i = 0; i < numCaptured; i++)
+    {
+        if (isReplayable(&requests[i]))
+            requests[numRequests++] = requests[i];
+    }
+    if (numRequests == 0)
+    {
+        fprintf(stderr, "Error: no replayable requests in %s\n", argv[optind]);
+        exit(1);
+    }
+    struct replayResult *results = mmap(NULL, sizeof(struct replayResult) * numRequests, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED)
+        error("ERROR mapping results");
+
+    /*-- Replay Requests On The Captured Schedule --*/
+    long firstUs = requests[0].startUs;
+    long baseUs = clockUs(CLOCK_MONOTONIC) + START_DELAY_US;
+    long wallBaseUs = clockUs(CLOCK_REALTIME) + START_DELAY_US;
+    fprintf(stderr, "REPLAY: %d of %d captured requests over %.1f s at %gx\n", numRequests, numCaptured,
+            (requests[numRequests - 1].startUs - firstUs) / 1e6 / speed, speed);
+    for (int i = 0; i < numRequests; i++)
+    {
+        long dueUs = baseUs + (long) ((requests[i].startUs - firstUs) / speed);
+        struct timespec due = {dueUs / 1000000, dueUs % 1000000 * 1000};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+            ;
+
+        // hold back while too many requests are in flight, which shows up as the replay falling behind
+        while (numChildren >= MAX_CHILDREN && wait(NULL) > 0)
+            numChildren--;
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            numChildren--;
+
+        long sentUs = clockUs(CLOCK_MONOTONIC);
+        results[i].lateUs = sentUs - dueUs;
+        int portNumber = strcmp(requests[i].op, "enc") == 0 ? encPort : decPort;
+        pid_t childPid = fork();
+        switch (childPid)
+        {
+        // for errors - request is recorded as failed
+        case -1:
+            perror("fork()\n");
+            break;
+
+        // for child processes - run the request and record how it went
+        case 0:
+            results[i].status = replayRequest(&requests[i], portNumber, 0x9E3779B97F4A7C15UL * (i + 1));
+            results[i].latencyUs = clockUs(CLOCK_MONOTONIC) - sentUs;
+            _exit(0);
+
+        // for parent process - go on to the next request
+        default:
+            numChildren++;
+        }
+    }
+    while (wait(NULL) > 0)
+        ;
+
+    /*-- Report Latencies --*/
+    struct request *replayed = malloc(sizeof(struct request) * numRequests);
+    long *late = malloc(sizeof(long) * numRequests);
+    if (replayed == NULL || late == NULL)
+        error("ERROR allocating replay results");
+    for (int i = 0; i < numRequests; i++)
+    {
+        replayed[i] = requests[i];
+        replayed[i].startUs = wallBaseUs + (long) ((requests[i].startUs - firstUs) / speed);
+        replayed[i].totalUs = results[i].latencyUs;
+        strcpy(replayed[i].result, STATUS_NAMES[results[i].status]);
+        late[i] = results[i].lateUs;
+    }
+    printComparison("capture", requests, numRequests, "replay", replayed, numRequests);
+    qsort(late, numRequests, sizeof(long), compareLong);
+    printf("requests sent behind schedule by p50 %ld us, p99 %ld us, max %ld us\n", late[(numRequests - 1) / 2],
+           late[(numRequests - 1) * 99 / 100], late[numRequests - 1]);
+    if (outputName != NULL)
+        writeReplay(outputName, replayed, numRequests);
+    return 0;
+}